@@ -0,0 +1,245 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "mybuf.h"
+
+/** Upper bound on the number of runs per mode */
+#define MAX_REPEATS 31
+
+/**
+ * Measures the effect of large appends on a concurrently running, cache
+ * sensitive workload.
+ *
+ * A worker thread repeatedly walks a working set sized to fit in the shared
+ * cache, standing in for request handlers, while the main thread appends
+ * large payloads to a contig1 buffer and chops them off again, as a send
+ * path would. The worker's progress, and where perf events are available
+ * its last level cache misses, are only counted while the appends run.
+ * Each mode (streaming copies disabled and enabled) is run several times,
+ * alternating, and the median of each figure is reported.
+ *
+ * Usage: bench [working set KB] [payload KB] [iterations] [repeats]
+ */
+
+typedef struct {
+    char *mem;
+    unsigned long size;
+    volatile int ready;
+    volatile int stop;
+    volatile unsigned long passes;
+    int fd;
+    unsigned long sink;
+} worker_t;
+
+typedef struct {
+    double append_mbs;
+    double passes_sec;
+    double misses_pass;
+    int have_misses;
+} result_t;
+
+#ifdef __linux__
+static int
+open_miss_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_LL |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void *
+worker_run(void *arg)
+{
+    worker_t *w = arg;
+    unsigned long ii, sum = 0;
+
+    /** Counts this thread; enabled by the main thread for the window */
+#ifdef __linux__
+    w->fd = open_miss_counter();
+#else
+    w->fd = -1;
+#endif
+    w->ready = 1;
+
+    while (!w->stop) {
+        /** One load per cache line */
+        for (ii = 0; ii < w->size; ii += 64) {
+            sum += (unsigned char)w->mem[ii];
+        }
+        w->passes++;
+    }
+    w->sink = sum;
+    return NULL;
+}
+
+static double
+now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+run(result_t *res, unsigned long wset, unsigned long payload,
+    unsigned long iterations)
+{
+    worker_t w;
+    pthread_t thr;
+    mybuf_contig1_t buf;
+    char *src = malloc(payload);
+    double begin, elapsed;
+    unsigned long ii, passes;
+
+    memset(&w, 0, sizeof(w));
+    memset(res, 0, sizeof(*res));
+    w.size = wset;
+    w.mem = malloc(wset);
+    memset(w.mem, 1, wset);
+    memset(src, 2, payload);
+
+    mybuf_contig1_init(&buf);
+    /** Warm up, so that the buffer has reached its final size */
+    mybuf_contig1_append(&buf, src, payload);
+    mybuf_contig1_chop(&buf, payload);
+
+    pthread_create(&thr, NULL, worker_run, &w);
+    while (!w.ready) {
+        ;
+    }
+
+#ifdef __linux__
+    if (w.fd >= 0) {
+        ioctl(w.fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(w.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    passes = w.passes;
+    begin = now_sec();
+    for (ii = 0; ii < iterations; ii++) {
+        mybuf_contig1_append(&buf, src, payload);
+        mybuf_contig1_chop(&buf, payload);
+    }
+    elapsed = now_sec() - begin;
+    passes = w.passes - passes;
+#ifdef __linux__
+    if (w.fd >= 0) {
+        long long count;
+        ioctl(w.fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(w.fd, &count, sizeof(count)) == sizeof(count)) {
+            res->misses_pass = (double)count / (passes + 1);
+            res->have_misses = 1;
+        }
+    }
+#endif
+
+    w.stop = 1;
+    pthread_join(thr, NULL);
+#ifdef __linux__
+    if (w.fd >= 0) {
+        close(w.fd);
+    }
+#endif
+
+    res->append_mbs = payload * (double)iterations / elapsed / 1e6;
+    res->passes_sec = passes / elapsed;
+
+    mybuf_contig1_cleanup(&buf);
+    free(w.mem);
+    free(src);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : da > db;
+}
+
+/** Median of field 'off' (a double within result_t) across 'n' results */
+static double
+median(const result_t *res, unsigned long n, size_t off)
+{
+    double vals[MAX_REPEATS];
+    unsigned long ii;
+    for (ii = 0; ii < n; ii++) {
+        vals[ii] = *(const double *)((const char *)(res + ii) + off);
+    }
+    qsort(vals, n, sizeof(vals[0]), cmp_double);
+    return n % 2 ? vals[n / 2] : (vals[n / 2 - 1] + vals[n / 2]) / 2;
+}
+
+static void
+report(const char *label, const result_t *res, unsigned long n)
+{
+    printf("%-10s append: %8.1f MB/s   worker: %8.1f passes/s", label,
+           median(res, n, offsetof(result_t, append_mbs)),
+           median(res, n, offsetof(result_t, passes_sec)));
+    if (res[0].have_misses) {
+        printf("   LLC misses/pass: %.0f",
+               median(res, n, offsetof(result_t, misses_pass)));
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long wset = 4096, payload = 512, iterations = 2000, repeats = 5;
+    unsigned long ii, threshold = mybuf_settings.nt_threshold;
+    result_t cached[MAX_REPEATS], streaming[MAX_REPEATS];
+
+    if (argc > 1) {
+        wset = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        payload = strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        iterations = strtoul(argv[3], NULL, 10);
+    }
+    if (argc > 4) {
+        repeats = strtoul(argv[4], NULL, 10);
+    }
+    if (!repeats || repeats > MAX_REPEATS) {
+        fprintf(stderr, "repeats must be between 1 and %d\n", MAX_REPEATS);
+        return EXIT_FAILURE;
+    }
+
+    printf("working set %lu KB, payload %lu KB, %lu iterations, "
+           "median of %lu runs\n", wset, payload, iterations, repeats);
+
+    /** Alternate the modes, so that drift affects both alike */
+    for (ii = 0; ii < repeats; ii++) {
+        mybuf_settings.nt_threshold = 0;
+        run(cached + ii, wset * 1024, payload * 1024, iterations);
+        mybuf_settings.nt_threshold = threshold ? threshold : 1;
+        run(streaming + ii, wset * 1024, payload * 1024, iterations);
+    }
+
+    report("cached", cached, repeats);
+    report("streaming", streaming, repeats);
+    return 0;
+}
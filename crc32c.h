@@ -0,0 +1,32 @@
+#ifndef MYBUF_CRC32C_H
+#define MYBUF_CRC32C_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * CRC32C (Castagnoli) checksum. Uses the SSE4.2 crc32 instruction when the
+ * CPU supports it, detected at runtime, and a table driven implementation
+ * otherwise.
+ *
+ * Checksums may be computed incrementally by passing the result of the
+ * previous call as 'crc'; the initial value is 0:
+ *
+ *      crc = mybuf_crc32c(0, a, na);
+ *      crc = mybuf_crc32c(crc, b, nb);
+ */
+unsigned int mybuf_crc32c(unsigned int crc, const void *data,
+                          unsigned long ndata);
+
+/**
+ * Flush hook (see mybuf_regpool_set_flush_hook()) accumulating the checksum
+ * of all flushed bytes into the `unsigned int` pointed to by 'arg'. Reset
+ * it to 0 to begin a new batch.
+ */
+void mybuf_crc32c_hook(void *arg, const void *data, unsigned long ndata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* MYBUF_CRC32C_H */
@@ -0,0 +1,153 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "dgram.h"
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/** Kernel limit on the number of segments in a single GSO message */
+#define GSO_MAX_SEGS 64
+
+/** Largest UDP payload over IPv4 */
+#define GSO_MAX_BYTES 65507
+
+#ifndef IP_MTU
+#define IP_MTU 14
+#endif
+
+/** IP and UDP header sizes, subtracted from the path MTU */
+#define GSO_HDR_IPV4 (20 + 8)
+#define GSO_HDR_IPV6 (40 + 8)
+
+/**
+ * Determines the largest segment size the kernel accepts for 'fd': the path
+ * MTU less the IP and UDP headers. Larger segments fail the whole message
+ * with EINVAL. The path MTU is only known for connected sockets.
+ * @return the limit, or 0 if it could not be determined
+ */
+static unsigned long
+gso_path_limit(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss), mtulen;
+    int mtu = 0;
+
+    if (getsockname(fd, (struct sockaddr *)&ss, &sslen) != 0) {
+        return 0;
+    }
+
+    mtulen = sizeof(mtu);
+    if (ss.ss_family == AF_INET) {
+        if (getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &mtulen) == 0 &&
+                mtu > GSO_HDR_IPV4) {
+            return mtu - GSO_HDR_IPV4;
+        }
+    } else if (ss.ss_family == AF_INET6) {
+        if (getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &mtulen) == 0 &&
+                mtu > GSO_HDR_IPV6) {
+            return mtu - GSO_HDR_IPV6;
+        }
+    }
+    return 0;
+}
+
+int
+mybuf_regpool_sendmmsg(mybuf_regpool_t *pool, int fd,
+                       const struct sockaddr *to, unsigned int tolen,
+                       int options, unsigned int gso_size)
+{
+    mybuf_generic_iov regions[MYBUF_DGRAM_BATCH];
+    struct iovec iovs[MYBUF_DGRAM_BATCH];
+    struct mmsghdr msgs[MYBUF_DGRAM_BATCH];
+
+    /** Number of regions (and thus datagrams) carried by each message */
+    unsigned int nsegs[MYBUF_DGRAM_BATCH];
+
+    union {
+        char buf[CMSG_SPACE(sizeof(unsigned short))];
+        struct cmsghdr align;
+    } ctrl[MYBUF_DGRAM_BATCH];
+
+    unsigned int ii, nregions, nmsgs = 0, ndone = 0;
+    unsigned long gso_max = 0;
+    int rv, saved_errno;
+
+    nregions = mybuf_regpool_dgram_get(pool, regions, MYBUF_DGRAM_BATCH);
+    if (!nregions) {
+        mybuf_regpool_dgram_done(pool, 0);
+        return 0;
+    }
+
+    for (ii = 0; ii < nregions; ii++) {
+        iovs[ii].iov_base = regions[ii].iov_base;
+        iovs[ii].iov_len = regions[ii].iov_len;
+    }
+    memset(msgs, 0, sizeof(msgs[0]) * nregions);
+
+    if (options & MYBUF_DGRAM_F_GSO) {
+        gso_max = gso_size ? gso_size : gso_path_limit(fd);
+    }
+
+    for (ii = 0; ii < nregions; nmsgs++) {
+        struct msghdr *mh = &msgs[nmsgs].msg_hdr;
+        unsigned int nseg = 1;
+        unsigned long seglen = iovs[ii].iov_len;
+
+        if (seglen && seglen <= gso_max) {
+            while (ii + nseg < nregions && nseg < GSO_MAX_SEGS &&
+                    iovs[ii + nseg].iov_len == seglen &&
+                    (nseg + 1) * seglen <= GSO_MAX_BYTES) {
+                nseg++;
+            }
+        }
+
+        mh->msg_name = (void *)to;
+        mh->msg_namelen = to ? tolen : 0;
+        mh->msg_iov = iovs + ii;
+        mh->msg_iovlen = nseg;
+
+        if (nseg > 1) {
+            struct cmsghdr *cm;
+            unsigned short seg16 = (unsigned short)seglen;
+
+            mh->msg_control = ctrl[nmsgs].buf;
+            mh->msg_controllen = sizeof(ctrl[nmsgs].buf);
+            cm = CMSG_FIRSTHDR(mh);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(seg16));
+            memcpy(CMSG_DATA(cm), &seg16, sizeof(seg16));
+        }
+
+        nsegs[nmsgs] = nseg;
+        ii += nseg;
+    }
+
+    do {
+        rv = sendmmsg(fd, msgs, nmsgs, 0);
+    } while (rv == -1 && errno == EINTR);
+    saved_errno = errno;
+
+    for (ii = 0; (int)ii < rv; ii++) {
+        ndone += nsegs[ii];
+    }
+    mybuf_regpool_dgram_done(pool, ndone);
+
+    if (rv < 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    return (int)ndone;
+}
+
+#endif /* __linux__ */
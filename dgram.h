@@ -0,0 +1,76 @@
+#ifndef MYBUF_DGRAM_H
+#define MYBUF_DGRAM_H
+
+#include "mybuf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Datagram flush mode for region pools.
+ *
+ * In stream mode (iov_get/iov_done) adjacent regions are merged and their
+ * boundaries are lost. In datagram mode each queued region is emitted as
+ * exactly one datagram, in queue order.
+ *
+ * Datagram and stream flushes may be used on the same pool, but a stream
+ * write which ends midway through a region causes the remainder of that
+ * region to be sent as its own datagram.
+ */
+
+/** Maximum number of datagrams handled by a single call */
+#define MYBUF_DGRAM_BATCH 64
+
+/** Send equal-sized runs of regions as one UDP GSO (UDP_SEGMENT) message */
+#define MYBUF_DGRAM_F_GSO 0x01
+
+/**
+ * Get one IOV per queued region, without merging adjacent regions. The pool
+ * is pinned until dgram_done() is called.
+ * @param pool the pool
+ * @param iov an array of at least 'niov' elements
+ * @param niov size of the array
+ * @return the number of elements filled in
+ */
+unsigned int mybuf_regpool_dgram_get(mybuf_regpool_t *pool,
+                                     mybuf_generic_iov *iov,
+                                     unsigned int niov);
+
+/**
+ * Call once the first 'ndgrams' datagrams returned by dgram_get() have been
+ * sent. The corresponding regions are marked as flushed exactly as with
+ * iov_done().
+ */
+void mybuf_regpool_dgram_done(mybuf_regpool_t *pool, unsigned int ndgrams);
+
+#ifdef __linux__
+struct sockaddr;
+
+/**
+ * Sends up to MYBUF_DGRAM_BATCH queued regions with a single sendmmsg()
+ * call, one datagram per region, and marks those sent as flushed.
+ *
+ * @param fd a datagram socket
+ * @param to destination address, or NULL for a connected socket
+ * @param tolen length of 'to'
+ * @param options MYBUF_DGRAM_F_* flags. With MYBUF_DGRAM_F_GSO, runs of
+ *  regions of identical size are passed to the kernel as a single message
+ *  which it segments at their boundaries, saving per-datagram overhead.
+ * @param gso_size with MYBUF_DGRAM_F_GSO, the largest region size which may
+ *  be segmented; larger regions are sent as plain datagrams. This must not
+ *  exceed the path MTU less the IP and UDP headers, or the kernel rejects
+ *  the message. If 0, the limit is derived from the path MTU of a connected
+ *  socket, and GSO is not used for unconnected ones.
+ * @return the number of datagrams sent, or -1 with errno set if nothing
+ *  could be sent
+ */
+int mybuf_regpool_sendmmsg(mybuf_regpool_t *pool, int fd,
+                           const struct sockaddr *to, unsigned int tolen,
+                           int options, unsigned int gso_size);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* MYBUF_DGRAM_H */
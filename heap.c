@@ -0,0 +1,140 @@
+#include "heap.h"
+
+void lcb_heap_init(lcb_heap_t *heap, lcb_heap_cmp_fn cmp)
+{
+    heap->root = NULL;
+    heap->cmp = cmp;
+}
+
+/* Links two detached trees, returning the new root */
+static lcb_heap_node_t *heap_meld(lcb_heap_t *heap,
+                                  lcb_heap_node_t *a, lcb_heap_node_t *b)
+{
+    lcb_heap_node_t *tmp;
+
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+    if (heap->cmp(b, a) < 0) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    b->prev = a;
+    b->next = a->child;
+    if (a->child) {
+        a->child->prev = b;
+    }
+    a->child = b;
+    return a;
+}
+
+/* Standard two-pass merge of a sibling list */
+static lcb_heap_node_t *heap_merge_pairs(lcb_heap_t *heap,
+                                         lcb_heap_node_t *first)
+{
+    lcb_heap_node_t *a, *b, *rest, *paired = NULL, *result = NULL;
+
+    /* Left to right: meld adjacent pairs, building a reversed list */
+    while (first) {
+        a = first;
+        b = a->next;
+        rest = b ? b->next : NULL;
+        a->next = a->prev = NULL;
+        if (b) {
+            b->next = b->prev = NULL;
+        }
+        a = heap_meld(heap, a, b);
+        a->next = paired;
+        paired = a;
+        first = rest;
+    }
+
+    /* Right to left: meld everything into a single tree */
+    while (paired) {
+        a = paired;
+        paired = a->next;
+        a->next = NULL;
+        result = heap_meld(heap, result, a);
+    }
+
+    return result;
+}
+
+void lcb_heap_push(lcb_heap_t *heap, lcb_heap_node_t *item)
+{
+    item->child = item->next = item->prev = NULL;
+    heap->root = heap_meld(heap, heap->root, item);
+}
+
+lcb_heap_node_t *lcb_heap_pop(lcb_heap_t *heap)
+{
+    lcb_heap_node_t *item = heap->root;
+
+    if (item) {
+        heap->root = heap_merge_pairs(heap, item->child);
+        if (heap->root) {
+            heap->root->prev = NULL;
+        }
+        item->child = item->next = item->prev = NULL;
+    }
+    return item;
+}
+
+void lcb_heap_delete(lcb_heap_t *heap, lcb_heap_node_t *item)
+{
+    lcb_heap_node_t *sub;
+
+    if (item == heap->root) {
+        lcb_heap_pop(heap);
+        return;
+    }
+
+    /* Detach the item's subtree from its parent or left sibling */
+    if (item->prev->child == item) {
+        item->prev->child = item->next;
+    } else {
+        item->prev->next = item->next;
+    }
+    if (item->next) {
+        item->next->prev = item->prev;
+    }
+
+    sub = heap_merge_pairs(heap, item->child);
+    if (sub) {
+        sub->prev = NULL;
+    }
+    heap->root = heap_meld(heap, heap->root, sub);
+    item->child = item->next = item->prev = NULL;
+}
+
+static lcb_heap_node_t *heap_parent(lcb_heap_node_t *item)
+{
+    while (item->prev && item->prev->child != item) {
+        item = item->prev;
+    }
+    return item->prev;
+}
+
+void lcb_heap_walk(lcb_heap_t *heap, lcb_heap_walk_fn fn, void *arg)
+{
+    lcb_heap_node_t *cur = heap->root;
+
+    while (cur) {
+        fn(cur, arg);
+        if (cur->child) {
+            cur = cur->child;
+            continue;
+        }
+        while (cur && !cur->next) {
+            cur = heap_parent(cur);
+        }
+        if (cur) {
+            cur = cur->next;
+        }
+    }
+}
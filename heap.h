@@ -0,0 +1,77 @@
+#ifndef MYBUF_HEAP_H
+#define MYBUF_HEAP_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Intrusive pairing heap
+     *
+     * Insertion and removal of arbitrary items are O(1) and O(log n)
+     * amortized respectively, making this suitable for priority queues and
+     * timers where lcb_list_add_sorted() would be O(n) per insert.
+     *
+     * Embed a node in your structure:
+     *
+     *      typedef struct {
+     *          lcb_heap_node_t hn;
+     *          lcb_uint32_t msec;
+     *      } lcb_timer_t;
+     *
+     * Define the ordering; the smallest item is at the top:
+     *
+     *      static int timer_cmp(lcb_heap_node_t *a, lcb_heap_node_t *b) {
+     *          lcb_timer_t *ta = LCB_HEAP_ITEM(a, lcb_timer_t, hn);
+     *          lcb_timer_t *tb = LCB_HEAP_ITEM(b, lcb_timer_t, hn);
+     *          return ta->msec < tb->msec ? -1 : ta->msec > tb->msec;
+     *      }
+     *
+     *      lcb_heap_t timers;
+     *      lcb_heap_init(&timers, timer_cmp);
+     *      lcb_heap_push(&timers, &t->hn);
+     *
+     * Drain in order:
+     *
+     *      while ((hn = lcb_heap_pop(&timers)) != NULL) {
+     *          t = LCB_HEAP_ITEM(hn, lcb_timer_t, hn);
+     *      }
+     */
+    typedef struct lcb_heap_node_s lcb_heap_node_t;
+    struct lcb_heap_node_s {
+        /** Leftmost child */
+        lcb_heap_node_t *child;
+        /** Next sibling */
+        lcb_heap_node_t *next;
+        /** Previous sibling, or the parent for a leftmost child */
+        lcb_heap_node_t *prev;
+    };
+
+    typedef int (*lcb_heap_cmp_fn)(lcb_heap_node_t *a, lcb_heap_node_t *b);
+    typedef void (*lcb_heap_walk_fn)(lcb_heap_node_t *node, void *arg);
+
+    typedef struct {
+        lcb_heap_node_t *root;
+        lcb_heap_cmp_fn cmp;
+    } lcb_heap_t;
+
+    void lcb_heap_init(lcb_heap_t *heap, lcb_heap_cmp_fn cmp);
+    void lcb_heap_push(lcb_heap_t *heap, lcb_heap_node_t *item);
+    lcb_heap_node_t *lcb_heap_pop(lcb_heap_t *heap);
+    void lcb_heap_delete(lcb_heap_t *heap, lcb_heap_node_t *item);
+
+    /** Visits every item in no particular order. 'fn' must not modify the heap */
+    void lcb_heap_walk(lcb_heap_t *heap, lcb_heap_walk_fn fn, void *arg);
+
+#define LCB_HEAP_IS_EMPTY(heap) ((heap)->root == NULL)
+
+#define LCB_HEAP_PEEK(heap) ((heap)->root)
+
+#define LCB_HEAP_ITEM(ptr, type, member) \
+    ((type *) ((char *)(ptr) - offsetof(type, member)))
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -4,26 +4,203 @@
 #include <stddef.h>
 
 #include "mybuf.h"
+#include "trace.h"
+#include "dgram.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_STREAMING_COPY 1
+#include <immintrin.h>
+#endif
 
 
 /** Default buffer allocation size */
 #define BUFFER_ALLOC_INIT 1024
 
+/** Default size from which copies bypass the cache */
+#define BUFFER_NT_THRESHOLD (256 * 1024)
+
+mybuf_settings_t mybuf_settings = {
+    BUFFER_ALLOC_INIT, 200, 50, BUFFER_NT_THRESHOLD
+};
+mybuf_stats_t mybuf_stats;
+int mybuf_stats_enabled = 0;
+
+#define TRACE(op, obj, arg, child) do { \
+    if (mybuf_trace_active) { mybuf_trace_record(op, obj, arg, child); } \
+} while (0)
+
+static void
+stats_alloc(unsigned long delta)
+{
+    if (!mybuf_stats_enabled) {
+        return;
+    }
+    mybuf_stats.nallocs++;
+    mybuf_stats.cur_bytes += delta;
+    if (mybuf_stats.cur_bytes > mybuf_stats.peak_bytes) {
+        mybuf_stats.peak_bytes = mybuf_stats.cur_bytes;
+    }
+}
+
+static void
+stats_free(unsigned long size)
+{
+    if (!mybuf_stats_enabled) {
+        return;
+    }
+    /** The memory may have been allocated before counting was enabled */
+    mybuf_stats.cur_bytes -= size < mybuf_stats.cur_bytes ?
+            size : mybuf_stats.cur_bytes;
+}
+
+static void
+stats_copied(unsigned long n)
+{
+    if (mybuf_stats_enabled) {
+        mybuf_stats.bytes_copied += n;
+    }
+}
+
+#ifdef HAVE_STREAMING_COPY
+/**
+ * Copies with non-temporal stores, which write around the cache. Safe for
+ * overlapping moves towards lower addresses, as each block is loaded in full
+ * before being stored. The trailing fence orders the stores before any
+ * subsequent store which publishes the data (e.g. a length update).
+ */
+__attribute__((target("sse2")))
+static void
+copy_streaming(char *dst, const char *src, unsigned long n)
+{
+    unsigned long head = (16 - ((size_t)dst & 15)) & 15;
+
+    /** Streaming stores require an aligned destination */
+    if (head > n) {
+        head = n;
+    }
+    memmove(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+
+    memmove(dst, src, n);
+    _mm_sfence();
+}
+
+static int
+have_streaming_copy(void)
+{
+    static int supported = -1;
+    if (supported == -1) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("sse2") ? 1 : 0;
+    }
+    return supported;
+}
+#endif
+
+/**
+ * Copies 'n' bytes, bypassing the cache for copies above the configured
+ * threshold. If 'overlap' is set, 'dst' may overlap 'src'. The copy is not
+ * accounted for; see copy_bytes()
+ */
+static void
+copy_uncounted(char *dst, const char *src, unsigned long n, int overlap)
+{
+#ifdef HAVE_STREAMING_COPY
+    if (mybuf_settings.nt_threshold && n >= mybuf_settings.nt_threshold &&
+            (!overlap || dst < src) && have_streaming_copy()) {
+        copy_streaming(dst, src, n);
+        return;
+    }
+#endif
+
+    if (overlap) {
+        memmove(dst, src, n);
+    } else {
+        memcpy(dst, src, n);
+    }
+}
+
+static void
+copy_bytes(char *dst, const char *src, unsigned long n, int overlap)
+{
+    stats_copied(n);
+    copy_uncounted(dst, src, n, overlap);
+}
+
+static void
+contig1_init(mybuf_contig1_t *buf)
+{
+    buf->alloc = mybuf_settings.alloc_init;
+    buf->data = malloc(buf->alloc);
+    buf->length = 0;
+    buf->start_offset = 0;
+    buf->flags = 0;
+    stats_alloc(buf->alloc);
+}
+
+static void
+contig1_cleanup(mybuf_contig1_t *buf)
+{
+    if ((buf->flags & MYBUF_CONTIG1_F_EXTERNAL) == 0) {
+        stats_free(buf->alloc);
+        free(buf->data);
+    }
+    memset(buf, 0, sizeof(*buf));
+}
+
+static void
+contig1_compact(mybuf_contig1_t *buf)
+{
+    /** Figure out whether to use memcpy or memmove. memcpy is quicker */
+    copy_bytes(buf->data, MYBUF_CONTIG1_HEAD(buf), buf->length,
+               buf->data + buf->length >= MYBUF_CONTIG1_HEAD(buf));
+    buf->start_offset = 0;
+}
 
 void
 mybuf_contig1_init(mybuf_contig1_t *buf)
 {
-    buf->data = malloc(BUFFER_ALLOC_INIT);
-    buf->alloc = 1024;
+    contig1_init(buf);
+    TRACE(MYBUF_TRACE_CONTIG1_INIT, buf, 0, NULL);
+}
+
+void
+mybuf_contig1_init_inline(mybuf_contig1_t *buf, void *mem, unsigned long nmem)
+{
+    buf->data = mem;
+    buf->alloc = nmem;
     buf->length = 0;
     buf->start_offset = 0;
+    buf->flags = MYBUF_CONTIG1_F_EXTERNAL;
+    TRACE(MYBUF_TRACE_CONTIG1_INIT_INLINE, buf, nmem, NULL);
 }
 
 void
 mybuf_contig1_cleanup(mybuf_contig1_t *buf)
 {
-    free(buf->data);
-    memset(buf, 0, sizeof(*buf));
+    TRACE(MYBUF_TRACE_CONTIG1_CLEANUP, buf, 0, NULL);
+    contig1_cleanup(buf);
+}
+
+void
+mybuf_contig1_move(mybuf_contig1_t *dst, mybuf_contig1_t *src)
+{
+    TRACE(MYBUF_TRACE_CONTIG1_MOVE, src, 0, dst);
+    *dst = *src;
+    memset(src, 0, sizeof(*src));
 }
 
 
@@ -31,6 +208,7 @@ void *
 mybuf_contig1_get_segment(mybuf_contig1_t *buf, unsigned long size)
 {
     void *ret;
+    unsigned long old_alloc;
 
     if (MYBUF_CONTIG1_SPACE(buf) >= size) {
         ret = MYBUF_CONTIG1_TAIL(buf);
@@ -39,15 +217,29 @@ mybuf_contig1_get_segment(mybuf_contig1_t *buf, unsigned long size)
     }
 
     if (MYBUF_CONTIG1_MAXSPACE(buf) >= size) {
-        mybuf_contig1_compact(buf);
+        contig1_compact(buf);
         return mybuf_contig1_get_segment(buf, size);
     }
 
+    old_alloc = buf->alloc;
     while (MYBUF_CONTIG1_SPACE(buf) < size) {
-        buf->alloc *= 2;
+        unsigned long next = buf->alloc / 100 * mybuf_settings.growth_pct +
+                buf->alloc % 100 * mybuf_settings.growth_pct / 100;
+        buf->alloc = next > buf->alloc ? next : buf->alloc + size;
     }
 
-    buf->data = realloc(buf->data, buf->alloc);
+    if (buf->flags & MYBUF_CONTIG1_F_EXTERNAL) {
+        /** Outgrew the user's storage; only the live contents move */
+        char *mem = malloc(buf->alloc);
+        copy_bytes(mem, MYBUF_CONTIG1_HEAD(buf), buf->length, 0);
+        buf->data = mem;
+        buf->start_offset = 0;
+        buf->flags &= ~MYBUF_CONTIG1_F_EXTERNAL;
+        stats_alloc(buf->alloc);
+    } else {
+        buf->data = realloc(buf->data, buf->alloc);
+        stats_alloc(buf->alloc - old_alloc);
+    }
     return mybuf_contig1_get_segment(buf, size);
 }
 
@@ -56,21 +248,34 @@ void
 mybuf_contig1_append(mybuf_contig1_t *buf,
                      const void *data, unsigned long ndata)
 {
-    void *mem = mybuf_contig1_get_segment(buf, ndata);
-    memcpy(mem, data, ndata);
+    void *mem;
+
+    TRACE(MYBUF_TRACE_CONTIG1_APPEND, buf, ndata, NULL);
+    mem = mybuf_contig1_get_segment(buf, ndata);
+    copy_bytes(mem, data, ndata, 0);
+}
+
+void *
+mybuf_contig1_reserve(mybuf_contig1_t *buf, unsigned long ndata)
+{
+    TRACE(MYBUF_TRACE_CONTIG1_APPEND, buf, ndata, NULL);
+    stats_copied(ndata);
+    return mybuf_contig1_get_segment(buf, ndata);
+}
+
+void
+mybuf_contig1_fill(void *dst, const void *src, unsigned long n)
+{
+    /** Already counted by reserve() */
+    copy_uncounted(dst, src, n, 0);
 }
 
 
 void
 mybuf_contig1_compact(mybuf_contig1_t *buf)
 {
-    /** Figure out whether to use memcpy or memmove. memcpy is quicker */
-    if (buf->data + buf->length < MYBUF_CONTIG1_HEAD(buf)) {
-        memcpy(buf->data, MYBUF_CONTIG1_HEAD(buf), buf->length);
-    } else {
-        memmove(buf->data, MYBUF_CONTIG1_HEAD(buf), buf->length);
-    }
-    buf->start_offset = 0;
+    TRACE(MYBUF_TRACE_CONTIG1_COMPACT, buf, 0, NULL);
+    contig1_compact(buf);
 }
 
 void
@@ -83,9 +288,57 @@ mybuf_contig1_chop_nocompact(mybuf_contig1_t *buf, unsigned long offset)
 void
 mybuf_contig1_chop(mybuf_contig1_t *buf, unsigned long offset)
 {
+    TRACE(MYBUF_TRACE_CONTIG1_CHOP, buf, offset, NULL);
     mybuf_contig1_chop_nocompact(buf, offset);
-    if (buf->start_offset > buf->alloc / 2) {
-        mybuf_contig1_compact(buf);
+    if (buf->start_offset >
+            buf->alloc / 100 * mybuf_settings.compact_pct +
+            buf->alloc % 100 * mybuf_settings.compact_pct / 100) {
+        contig1_compact(buf);
+    }
+}
+
+static int
+region_prio_cmp(lcb_heap_node_t *a, lcb_heap_node_t *b)
+{
+    mybuf_region_t *ra = LCB_HEAP_ITEM(a, mybuf_region_t, hn);
+    mybuf_region_t *rb = LCB_HEAP_ITEM(b, mybuf_region_t, hn);
+
+    if (ra->priority != rb->priority) {
+        return ra->priority < rb->priority ? -1 : 1;
+    }
+    return ra->priority_seq < rb->priority_seq ? -1 : 1;
+}
+
+/**
+ * Merges prioritized regions into the send queue. Each is placed behind the
+ * queued regions of equal or lower priority value, but never ahead of a
+ * partially flushed head. As the heap yields regions in ascending order, the
+ * queue is only walked once.
+ */
+static void
+promote_prio_regions(mybuf_regpool_t *pool)
+{
+    lcb_heap_node_t *hn;
+    lcb_list_t *pos = &pool->regions.ll;
+
+    if (LCB_HEAP_IS_EMPTY(&pool->prio_regions)) {
+        return;
+    }
+    if (pool->flush_offset) {
+        pos = pos->next;
+    }
+
+    while ((hn = lcb_heap_pop(&pool->prio_regions)) != NULL) {
+        mybuf_region_t *region = LCB_HEAP_ITEM(hn, mybuf_region_t, hn);
+        region->flags &= ~MYBUF_REGION_F_PRIORITIZED;
+
+        while (pos->next != &pool->regions.ll &&
+                LCB_LIST_ITEM(pos->next, mybuf_region_t, ll)->priority <=
+                        region->priority) {
+            pos = pos->next;
+        }
+        lcb_list_prepend(pos, &region->ll);
+        pos = &region->ll;
     }
 }
 
@@ -96,13 +349,96 @@ mybuf_regpool_init(mybuf_regpool_t *pool)
     pool->pinned = 0;
     lcb_list_init(&pool->regions.ll);
     lcb_list_init(&pool->flushed_regions.ll);
-    mybuf_contig1_init(&pool->buf);
+    lcb_heap_init(&pool->prio_regions, region_prio_cmp);
+    contig1_init(&pool->buf);
+    TRACE(MYBUF_TRACE_REGPOOL_INIT, pool, 0, NULL);
+}
+
+static void
+shared_release(mybuf_shared_t *shared)
+{
+    if (--shared->refcount) {
+        return;
+    }
+    TRACE(MYBUF_TRACE_SHARED_FREE, shared, 0, NULL);
+    stats_free(sizeof(*shared) + shared->length);
+    free(shared);
+}
+
+/** Obtains a zeroed region structure, from the cache if possible */
+static mybuf_region_t *
+region_desc_alloc(mybuf_regpool_t *pool)
+{
+    mybuf_region_t *region = pool->desc_cache;
+
+    if (region) {
+        pool->desc_cache = region->next_free;
+        pool->ndesc_cache--;
+        memset(region, 0, sizeof(*region));
+    } else {
+        region = calloc(1, sizeof(*region));
+        stats_alloc(sizeof(*region));
+    }
+    region->pool = pool;
+    return region;
+}
+
+static void
+region_desc_free(mybuf_regpool_t *pool, mybuf_region_t *region)
+{
+    if (pool->ndesc_cache < MYBUF_REGPOOL_DESC_CACHE) {
+        region->next_free = pool->desc_cache;
+        pool->desc_cache = region;
+        pool->ndesc_cache++;
+    } else {
+        stats_free(sizeof(*region));
+        free(region);
+    }
+}
+
+static int
+remote_frees_pending(mybuf_regpool_t *pool)
+{
+#ifdef __GNUC__
+    return __atomic_load_n(&pool->remote_frees, __ATOMIC_RELAXED) != NULL;
+#else
+    return pool->remote_frees != NULL;
+#endif
+}
+
+static void
+release_shared_region(mybuf_regpool_t *pool, mybuf_region_t *region)
+{
+    shared_release(region->shared);
+    region_desc_free(pool, region);
 }
 
 void
-mybuf_regpool_clean(mybuf_regpool_t *pool)\
+mybuf_regpool_clean(mybuf_regpool_t *pool)
 {
-    mybuf_contig1_cleanup(&pool->buf);
+    lcb_list_t *cur_ll, *next_ll;
+
+    mybuf_regpool_drain_remote(pool);
+    TRACE(MYBUF_TRACE_REGPOOL_CLEAN, pool, 0, NULL);
+
+    /** Shared regions are owned by the pool; drop any still queued */
+    LCB_LIST_SAFE_FOR(cur_ll, next_ll, &pool->regions.ll) {
+        mybuf_region_t *cur = LCB_LIST_ITEM(cur_ll, mybuf_region_t, ll);
+        if (cur->flags & MYBUF_REGION_F_SHARED) {
+            lcb_list_delete(cur_ll);
+            release_shared_region(pool, cur);
+        }
+    }
+
+    while (pool->desc_cache) {
+        mybuf_region_t *region = pool->desc_cache;
+        pool->desc_cache = region->next_free;
+        stats_free(sizeof(*region));
+        free(region);
+    }
+    pool->ndesc_cache = 0;
+
+    contig1_cleanup(&pool->buf);
 }
 
 static void
@@ -110,7 +446,7 @@ update_single_region(mybuf_regpool_t *pool, mybuf_region_t *cur,
                      unsigned long old_offset, char *old_buffer)
 {
     unsigned long old_begin;
-    if (cur->flags & MYBUF_REGION_F_ALLOCATED) {
+    if (cur->flags & (MYBUF_REGION_F_ALLOCATED|MYBUF_REGION_F_SHARED)) {
         return; /* don't care */
     }
 
@@ -134,11 +470,26 @@ update_single_region(mybuf_regpool_t *pool, mybuf_region_t *cur,
     }
 }
 
+typedef struct {
+    mybuf_regpool_t *pool;
+    unsigned long old_offset;
+    char *old_buffer;
+} update_ctx_t;
+
+static void
+update_prio_region(lcb_heap_node_t *hn, void *arg)
+{
+    update_ctx_t *ctx = arg;
+    update_single_region(ctx->pool, LCB_HEAP_ITEM(hn, mybuf_region_t, hn),
+                         ctx->old_offset, ctx->old_buffer);
+}
+
 static void
 update_region_offsets(mybuf_regpool_t *pool,
                       unsigned long old_offset,
                       char *old_buffer)
 {
+    update_ctx_t ctx;
     lcb_list_t *cur_ll;
     LCB_LIST_FOR(cur_ll, &pool->regions.ll) {
         mybuf_region_t *cur = LCB_LIST_ITEM(cur_ll, mybuf_region_t, ll);
@@ -149,6 +500,11 @@ update_region_offsets(mybuf_regpool_t *pool,
         mybuf_region_t *cur = LCB_LIST_ITEM(cur_ll, mybuf_region_t, ll);
         update_single_region(pool, cur, old_offset, old_buffer);
     }
+
+    ctx.pool = pool;
+    ctx.old_offset = old_offset;
+    ctx.old_buffer = old_buffer;
+    lcb_heap_walk(&pool->prio_regions, update_prio_region, &ctx);
 }
 
 void
@@ -161,14 +517,20 @@ mybuf_regpool_get_region(mybuf_regpool_t *pool, unsigned long size,
      * ACTION:
      * Allocate the segment and return it
      */
+    if (remote_frees_pending(pool)) {
+        mybuf_regpool_drain_remote(pool);
+    }
+
     if (!*region) {
-        *region = calloc(1, sizeof(**region));
+        *region = region_desc_alloc(pool);
 
     } else {
         (*region)->flags |= MYBUF_REGION_F_STRUCTUALLOC;
+        (*region)->pool = pool;
     }
 
     (*region)->length = size;
+    (*region)->priority = MYBUF_REGION_PRIO_DEFAULT;
 
     if (MYBUF_CONTIG1_SPACE(&pool->buf) >= size) {
         (*region)->buf = mybuf_contig1_get_segment(&pool->buf, size);
@@ -189,17 +551,42 @@ mybuf_regpool_get_region(mybuf_regpool_t *pool, unsigned long size,
         } else {
             (*region)->flags |= MYBUF_REGION_F_ALLOCATED;
             (*region)->buf = malloc(size);
+            stats_alloc(size);
         }
     }
 
     lcb_list_append(&pool->regions.ll, &(*region)->ll);
+    TRACE(MYBUF_TRACE_GET_REGION, pool, size, *region);
 }
 
 
+void
+mybuf_regpool_set_priority(mybuf_regpool_t *pool, mybuf_region_t *region,
+                           unsigned long priority)
+{
+    TRACE(MYBUF_TRACE_SET_PRIORITY, region, priority, NULL);
+    assert((region->flags & MYBUF_REGION_F_FLUSHED) == 0);
+
+    if (region->flags & MYBUF_REGION_F_PRIORITIZED) {
+        lcb_heap_delete(&pool->prio_regions, &region->hn);
+    } else {
+        assert(pool->flush_offset == 0 || pool->regions.ll.next != &region->ll);
+        lcb_list_delete(&region->ll);
+        region->flags |= MYBUF_REGION_F_PRIORITIZED;
+    }
+
+    region->priority = priority;
+    region->priority_seq = pool->prio_seq++;
+    lcb_heap_push(&pool->prio_regions, &region->hn);
+}
+
 void
 mybuf_regpool_pin(mybuf_regpool_t *pool, mybuf_region_t *region)
 {
-    if (region->flags & (MYBUF_REGION_F_ALLOCATED|MYBUF_REGION_F_PINNED)) {
+    TRACE(MYBUF_TRACE_PIN, region, 0, NULL);
+    if (region->flags & (MYBUF_REGION_F_ALLOCATED|
+                         MYBUF_REGION_F_SHARED|
+                         MYBUF_REGION_F_PINNED)) {
         return;
     }
 
@@ -210,7 +597,8 @@ mybuf_regpool_pin(mybuf_regpool_t *pool, mybuf_region_t *region)
 void
 mybuf_regpool_unpin(mybuf_regpool_t *pool, mybuf_region_t *region)
 {
-    if (region->flags & MYBUF_REGION_F_ALLOCATED) {
+    TRACE(MYBUF_TRACE_UNPIN, region, 0, NULL);
+    if (region->flags & (MYBUF_REGION_F_ALLOCATED|MYBUF_REGION_F_SHARED)) {
         return;
     }
     assert(region->flags & MYBUF_REGION_F_PINNED);
@@ -222,18 +610,129 @@ void
 mybuf_regpool_free_region(mybuf_regpool_t *pool, mybuf_region_t *region)
 {
     assert( (region->flags & MYBUF_REGION_F_PINNED) == 0);
+    assert( (region->flags & MYBUF_REGION_F_SHARED) == 0);
+    TRACE(MYBUF_TRACE_FREE_REGION, region, 0, NULL);
 
     if (region->flags & MYBUF_REGION_F_ALLOCATED) {
+        stats_free(region->length);
         free(region->buf);
 
     } else if (region->buf == MYBUF_CONTIG1_HEAD(&pool->buf)) {
         mybuf_contig1_chop_nocompact(&pool->buf, region->length);
     }
 
-    lcb_list_delete(&region->ll);
+    if (region->flags & MYBUF_REGION_F_PRIORITIZED) {
+        lcb_heap_delete(&pool->prio_regions, &region->hn);
+    } else {
+        lcb_list_delete(&region->ll);
+    }
 
     if ((region->flags & MYBUF_REGION_F_STRUCTUALLOC) == 0) {
-        free(region);
+        region_desc_free(pool, region);
+    }
+}
+
+#ifdef MYBUF_HAVE_REMOTE_FREE
+void
+mybuf_regpool_free_region_remote(mybuf_region_t *region)
+{
+    mybuf_regpool_t *pool = region->pool;
+    mybuf_region_t *head = __atomic_load_n(&pool->remote_frees,
+                                           __ATOMIC_RELAXED);
+    do {
+        region->next_free = head;
+    } while (!__atomic_compare_exchange_n(&pool->remote_frees, &head, region,
+                                          1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+#endif
+
+void
+mybuf_regpool_drain_remote(mybuf_regpool_t *pool)
+{
+    mybuf_region_t *head, *ordered = NULL;
+
+#ifdef __GNUC__
+    head = __atomic_exchange_n(&pool->remote_frees, NULL, __ATOMIC_ACQUIRE);
+#else
+    head = pool->remote_frees;
+    pool->remote_frees = NULL;
+#endif
+
+    /** Restore the order in which they were freed */
+    while (head) {
+        mybuf_region_t *next = head->next_free;
+        head->next_free = ordered;
+        ordered = head;
+        head = next;
+    }
+
+    while (ordered) {
+        mybuf_region_t *region = ordered;
+        ordered = region->next_free;
+        if (region->flags & MYBUF_REGION_F_PINNED) {
+            mybuf_regpool_unpin(pool, region);
+        }
+        mybuf_regpool_free_region(pool, region);
+    }
+}
+
+mybuf_shared_t *
+mybuf_shared_new(const void *data, unsigned long ndata)
+{
+    mybuf_shared_t *shared;
+
+    shared = malloc(sizeof(*shared) + ndata);
+    stats_alloc(sizeof(*shared) + ndata);
+    shared->refcount = 1;
+    shared->length = ndata;
+    if (data) {
+        memcpy(shared->data, data, ndata);
+        stats_copied(ndata);
+    }
+    TRACE(MYBUF_TRACE_SHARED_NEW, shared, ndata, NULL);
+    return shared;
+}
+
+void
+mybuf_shared_ref(mybuf_shared_t *shared)
+{
+    TRACE(MYBUF_TRACE_SHARED_REF, shared, 0, NULL);
+    shared->refcount++;
+}
+
+void
+mybuf_shared_unref(mybuf_shared_t *shared)
+{
+    TRACE(MYBUF_TRACE_SHARED_UNREF, shared, 0, NULL);
+    shared_release(shared);
+}
+
+void
+mybuf_regpool_add_shared(mybuf_regpool_t *pool, mybuf_shared_t *shared)
+{
+    mybuf_region_t *region;
+
+    TRACE(MYBUF_TRACE_ADD_SHARED, pool, 0, shared);
+
+    region = region_desc_alloc(pool);
+    region->flags = MYBUF_REGION_F_SHARED;
+    region->length = shared->length;
+    region->buf = shared->data;
+    region->shared = shared;
+    region->priority = MYBUF_REGION_PRIO_DEFAULT;
+    shared->refcount++;
+
+    lcb_list_append(&pool->regions.ll, &region->ll);
+}
+
+void
+mybuf_shared_fanout(mybuf_shared_t *shared,
+                    mybuf_regpool_t **pools, unsigned int npools)
+{
+    unsigned int ii;
+    for (ii = 0; ii < npools; ii++) {
+        mybuf_regpool_add_shared(pools[ii], shared);
     }
 }
 
@@ -252,6 +751,8 @@ mybuf_regpool_iov_get(mybuf_regpool_t *pool, mybuf_generic_iov *iov,
     unsigned int flush_offset;
     void *expected_pos = NULL;
 
+    TRACE(MYBUF_TRACE_IOV_GET, pool, niov, NULL);
+    promote_prio_regions(pool);
     flush_offset = pool->flush_offset;
 
     LCB_LIST_FOR(cur_ll, &pool->regions.ll) {
@@ -297,26 +798,135 @@ mybuf_regpool_iov_get(mybuf_regpool_t *pool, mybuf_generic_iov *iov,
     pool->pinned++;
 }
 
+/** Called for a region which has been removed from the send queue */
+static void
+flush_region(mybuf_regpool_t *pool, mybuf_region_t *region)
+{
+    if (region->flags & MYBUF_REGION_F_SHARED) {
+        release_shared_region(pool, region);
+        return;
+    }
+    region->flags |= MYBUF_REGION_F_FLUSHED;
+    lcb_list_append(&pool->flushed_regions.ll, &region->ll);
+}
+
+/**
+ * Passes the first 'nused' unflushed bytes to the flush hook, one call per
+ * region
+ */
+static void
+run_flush_hook(mybuf_regpool_t *pool, unsigned long nused)
+{
+    lcb_list_t *cur_ll;
+    unsigned long offset = pool->flush_offset;
+
+    LCB_LIST_FOR(cur_ll, &pool->regions.ll) {
+        mybuf_region_t *cur = LCB_LIST_ITEM(cur_ll, mybuf_region_t, ll);
+        unsigned long chunk = cur->length - offset;
+
+        if (!nused) {
+            break;
+        }
+        if (chunk > nused) {
+            chunk = nused;
+        }
+        if (chunk) {
+            pool->flush_hook(pool->flush_hook_arg, cur->buf + offset, chunk);
+        }
+        nused -= chunk;
+        offset = 0;
+    }
+}
+
+void
+mybuf_regpool_set_flush_hook(mybuf_regpool_t *pool,
+                             mybuf_flush_hook_fn hook, void *arg)
+{
+    pool->flush_hook = hook;
+    pool->flush_hook_arg = arg;
+}
+
 void
 mybuf_regpool_iov_done(mybuf_regpool_t *pool, unsigned long nused)
 {
-    pool->pinned--;
     lcb_list_t *cur_ll;
 
+    TRACE(MYBUF_TRACE_IOV_DONE, pool, nused, NULL);
+    pool->pinned--;
+
+    if (pool->flush_hook && nused) {
+        run_flush_hook(pool, nused);
+    }
+
     nused += pool->flush_offset;
     pool->flush_offset = 0;
 
-    while ( nused && (cur_ll = lcb_list_shift(&pool->regions.ll)) ) {
+    /** Zero-length regions (e.g. empty shared payloads) at the head go too */
+    while ( (cur_ll = lcb_list_shift(&pool->regions.ll)) ) {
         mybuf_region_t *cur = LCB_LIST_ITEM(cur_ll, mybuf_region_t, ll);
         if (nused >= cur->length) {
-            cur->flags |= MYBUF_REGION_F_FLUSHED;
             nused -= cur->length;
-            lcb_list_append(&pool->flushed_regions.ll, cur_ll);
+            flush_region(pool, cur);
 
         } else {
-            pool->flush_offset = cur->length - nused;
+            pool->flush_offset = nused;
             lcb_list_prepend(&pool->regions.ll, cur_ll);
             break;
         }
     }
 }
+
+unsigned int
+mybuf_regpool_dgram_get(mybuf_regpool_t *pool, mybuf_generic_iov *iov,
+                        unsigned int niov)
+{
+    lcb_list_t *cur_ll;
+    unsigned int ii = 0;
+    unsigned long flush_offset = pool->flush_offset;
+
+    TRACE(MYBUF_TRACE_DGRAM_GET, pool, niov, NULL);
+    promote_prio_regions(pool);
+
+    LCB_LIST_FOR(cur_ll, &pool->regions.ll) {
+        mybuf_region_t *cur = LCB_LIST_ITEM(cur_ll, mybuf_region_t, ll);
+        if (ii == niov) {
+            break;
+        }
+        iov[ii].iov_base = cur->buf + flush_offset;
+        iov[ii].iov_len = cur->length - flush_offset;
+        flush_offset = 0;
+        ii++;
+    }
+
+    pool->pinned++;
+    return ii;
+}
+
+void
+mybuf_regpool_dgram_done(mybuf_regpool_t *pool, unsigned int ndgrams)
+{
+    lcb_list_t *cur_ll;
+
+    TRACE(MYBUF_TRACE_DGRAM_DONE, pool, ndgrams, NULL);
+    pool->pinned--;
+
+    if (pool->flush_hook && ndgrams) {
+        unsigned int ii = 0;
+        unsigned long nbytes = 0;
+        LCB_LIST_FOR(cur_ll, &pool->regions.ll) {
+            if (ii++ == ndgrams) {
+                break;
+            }
+            nbytes += LCB_LIST_ITEM(cur_ll, mybuf_region_t, ll)->length;
+        }
+        run_flush_hook(pool, nbytes - pool->flush_offset);
+    }
+
+    if (ndgrams) {
+        pool->flush_offset = 0;
+    }
+
+    while (ndgrams-- && (cur_ll = lcb_list_shift(&pool->regions.ll))) {
+        flush_region(pool, LCB_LIST_ITEM(cur_ll, mybuf_region_t, ll));
+    }
+}
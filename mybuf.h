@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include "list.h"
+#include "heap.h"
 
 /**
  * Structures are labelled with a name and a number, in case more specialized
@@ -30,8 +31,17 @@ typedef struct {
 
     /** Length of used size of the buffer */
     unsigned long length;
+
+    /** MYBUF_CONTIG1_F_* */
+    unsigned char flags;
 } mybuf_contig1_t;
 
+/**
+ * 'data' is storage provided by the user (see init_inline()) and must not be
+ * reallocated or freed
+ */
+#define MYBUF_CONTIG1_F_EXTERNAL 0x01
+
 /** Space inside the buffer */
 #define MYBUF_CONTIG1_SPACE(buf) \
     ( (buf)->alloc - ((buf)->length + (buf)->start_offset))
@@ -47,11 +57,113 @@ typedef struct {
 #define MYBUF_CONTIG1_MAXSPACE(buf) \
     MYBUF_CONTIG1_SPACE(buf) + (buf)->start_offset
 
+/**
+ * Tunables affecting buffer growth and compaction. These are global and
+ * apply to every buffer; they are primarily meant to be adjusted when
+ * replaying a workload trace (see trace.h) to compare policies.
+ */
+typedef struct {
+    /** Initial allocation size of a contig1 buffer */
+    unsigned long alloc_init;
+
+    /** Percentage by which the allocation grows when it is full (200 = x2) */
+    unsigned int growth_pct;
+
+    /**
+     * A chopped buffer is compacted once its start offset exceeds this
+     * percentage of the allocation
+     */
+    unsigned int compact_pct;
+
+    /**
+     * Appends and compactions of at least this many bytes use non-temporal
+     * stores (where the CPU supports them), so that data which will only be
+     * read once by the kernel does not evict the rest of the cache. 0
+     * disables streaming copies.
+     */
+    unsigned long nt_threshold;
+} mybuf_settings_t;
+
+extern mybuf_settings_t mybuf_settings;
+
+/**
+ * Counters maintained by the buffer routines while mybuf_stats_enabled is
+ * set. These may be reset at any time by the caller. They are not
+ * synchronized, and so are approximate when pools are used from several
+ * threads.
+ */
+typedef struct {
+    /** Bytes moved by memcpy/memmove on append and compaction */
+    unsigned long bytes_copied;
+
+    /** Number of malloc/realloc calls */
+    unsigned long nallocs;
+
+    /** Bytes currently allocated for buffers and region structures */
+    unsigned long cur_bytes;
+
+    /** High watermark of cur_bytes */
+    unsigned long peak_bytes;
+} mybuf_stats_t;
+
+extern mybuf_stats_t mybuf_stats;
+
+/**
+ * The counters are only updated while this is non-zero, so that threads
+ * using their own buffers do not all write to the same cache line. It is
+ * set for as long as a trace is recorded or replayed (see trace.h), and
+ * may also be set by the application.
+ */
+extern int mybuf_stats_enabled;
+
 void mybuf_contig1_init(mybuf_contig1_t *buf);
 void mybuf_contig1_cleanup(mybuf_contig1_t *buf);
 
+/**
+ * Initializes the buffer on top of 'nmem' bytes of user-provided storage, so
+ * that no allocation takes place until the buffer outgrows it; the contents
+ * are then moved to the heap. The storage must outlive the buffer or remain
+ * valid until the buffer has moved to the heap.
+ */
+void mybuf_contig1_init_inline(mybuf_contig1_t *buf,
+                               void *mem, unsigned long nmem);
+
+/**
+ * Moves the buffer held by 'src' into the uninitialized structure 'dst',
+ * without copying its contents. 'src' is left zeroed, which is a valid empty
+ * buffer that allocates on first use. An inline buffer keeps referring to
+ * the same storage.
+ *
+ * Buffers must be moved this way (rather than by copying the structure) for
+ * a trace (see trace.h) to follow them.
+ */
+void mybuf_contig1_move(mybuf_contig1_t *dst, mybuf_contig1_t *src);
+
 void mybuf_contig1_append(mybuf_contig1_t *buf,
                    const void *data, unsigned long ndata);
+
+/**
+ * Extends the buffer by 'ndata' bytes and returns a pointer to them, for the
+ * caller to fill in. This is equivalent to append() without the copy; a
+ * caller copying into the space should use fill() so that large copies
+ * bypass the cache as they do in append().
+ */
+void *mybuf_contig1_reserve(mybuf_contig1_t *buf, unsigned long ndata);
+
+/**
+ * Copies 'n' bytes into space obtained from reserve(), using non-temporal
+ * stores from mybuf_settings.nt_threshold bytes.
+ */
+void mybuf_contig1_fill(void *dst, const void *src, unsigned long n);
+
+/**
+ * Inline form of reserve(), valid only while MYBUF_CONTIG1_SPACE() is at
+ * least 'n', no trace is active (see trace.h) and mybuf_stats_enabled is
+ * not set. Evaluates 'buf' and 'n' more than once.
+ */
+#define MYBUF_CONTIG1_RESERVE_INPLACE(buf, n) \
+    ( (buf)->length += (n), (void *)(MYBUF_CONTIG1_TAIL(buf) - (n)) )
+
 void mybuf_contig1_compact(mybuf_contig1_t *buf);
 void mybuf_contig1_chop(mybuf_contig1_t *buf, unsigned long offset);
 
@@ -76,9 +188,41 @@ typedef enum {
      * Buffer contents have been flushed (and thus is no longer a member
      * of the send queue list)
      */
-    MYBUF_REGION_F_FLUSHED = 1 << 3
+    MYBUF_REGION_F_FLUSHED = 1 << 3,
+
+    /**
+     * The region maps a refcounted shared buffer (see mybuf_shared_t) rather
+     * than memory owned by the pool. The region is owned by the pool and
+     * released, along with its reference, once it has been flushed.
+     */
+    MYBUF_REGION_F_SHARED = 1 << 4,
+
+    /**
+     * The region has been assigned a priority and is waiting in the pool's
+     * priority heap rather than the send queue
+     */
+    MYBUF_REGION_F_PRIORITIZED = 1 << 5
 } mybuf_region_flags_t;
 
+/**
+ * Immutable, refcounted payload which may be queued into any number of
+ * region pools without copying. Each pool holds a reference for as long as
+ * the payload is queued; the memory is freed once the last reference is
+ * dropped.
+ *
+ * Reference counting is not atomic; all pools sharing a payload must be
+ * driven from the same thread.
+ */
+typedef struct {
+    unsigned long refcount;
+
+    /** Length of the payload */
+    unsigned long length;
+
+    /** Payload; the structure is over-allocated to hold 'length' bytes */
+    char data[1];
+} mybuf_shared_t;
+
 /**
  * Structure representing a buffer region. A buffer region represents a mapping
  * within a given buffer, and contains a back pointer so that references may
@@ -89,6 +233,7 @@ typedef enum {
  * region may be dynamically updated (unless 'pin()' is called)
  */
 struct mybuf_region_st;
+struct mybuf_regpool_st;
 
 typedef struct mybuf_region_st {
     unsigned char flags;
@@ -101,8 +246,39 @@ typedef struct mybuf_region_st {
 
     /** Pointers to the next and previous regions within the order */
     lcb_list_t ll;
+
+    /** Backing payload, for MYBUF_REGION_F_SHARED regions */
+    mybuf_shared_t *shared;
+
+    /** Position in the priority heap, for MYBUF_REGION_F_PRIORITIZED */
+    lcb_heap_node_t hn;
+
+    /**
+     * Priority, lower values are flushed first. MYBUF_REGION_PRIO_DEFAULT
+     * unless set_priority() was called
+     */
+    unsigned long priority;
+
+    /** Insertion order, so that equal priorities are flushed in order */
+    unsigned long priority_seq;
+
+    /** Pool the region was obtained from */
+    struct mybuf_regpool_st *pool;
+
+    /** Link in the pool's remote free queue or descriptor cache */
+    struct mybuf_region_st *next_free;
 } mybuf_region_t;
 
+/** Priority of regions for which set_priority() was not called */
+#define MYBUF_REGION_PRIO_DEFAULT 0x8000UL
+
+/**
+ * Invoked for the acknowledged bytes of each region as it is flushed, in
+ * queue order.
+ */
+typedef void (*mybuf_flush_hook_fn)(void *arg, const void *data,
+                                    unsigned long ndata);
+
 /**
  * Next step in our buffer configuration:
  *
@@ -118,7 +294,7 @@ typedef struct mybuf_region_st {
  * the underlying contents of the buffer shall not be allocated, specifically
  * this means that routines like 'compact' and 'realloc' shall not be called.
  */
-typedef struct {
+typedef struct mybuf_regpool_st {
     mybuf_region_t regions;
     mybuf_region_t flushed_regions;
 
@@ -130,8 +306,29 @@ typedef struct {
 
     /** Underlying buffer structure */
     mybuf_contig1_t buf;
+
+    /** Prioritized regions not yet moved to the send queue */
+    lcb_heap_t prio_regions;
+    unsigned long prio_seq;
+
+    /** Optional hook for inspecting flushed data, see set_flush_hook() */
+    mybuf_flush_hook_fn flush_hook;
+    void *flush_hook_arg;
+
+    /**
+     * Regions released from other threads, pending release by the pool's
+     * own thread. Pushed to atomically, see free_region_remote()
+     */
+    mybuf_region_t *remote_frees;
+
+    /** Region structures kept for reuse by get_region() */
+    mybuf_region_t *desc_cache;
+    unsigned int ndesc_cache;
 } mybuf_regpool_t;
 
+/** Maximum number of region structures cached by a pool */
+#define MYBUF_REGPOOL_DESC_CACHE 64
+
 
 #define MYBUF_IOV_MAX 16
 typedef struct {
@@ -163,6 +360,24 @@ void mybuf_regpool_get_region(mybuf_regpool_t *pool,
                               mybuf_region_t **region);
 
 
+/**
+ * Assigns a priority to a region obtained from get_region(); lower values
+ * are flushed first. Rather than being flushed in the order it was obtained,
+ * the region is held back until the next iov_get() (or dgram_get()), at
+ * which point it is moved into the send queue ahead of every queued region
+ * with a higher priority value. It is placed behind queued regions of equal
+ * or lower value, and never ahead of a region which was partially flushed.
+ *
+ * Regions which were never assigned a priority (including shared regions)
+ * have MYBUF_REGION_PRIO_DEFAULT, so that values below it overtake regular
+ * traffic and values above it yield to it.
+ *
+ * This must be called before the region has been returned by iov_get().
+ */
+void mybuf_regpool_set_priority(mybuf_regpool_t *pool,
+                                mybuf_region_t *region,
+                                unsigned long priority);
+
 /**
  * 'pins' this region to its pointer. When a region is pinned, it is guaranteed
  * that the underlying '->buf' pointer will not change (e.g. the contents of
@@ -186,6 +401,64 @@ void mybuf_regpool_unpin(mybuf_regpool_t *pool, mybuf_region_t *region);
 void mybuf_regpool_free_region(mybuf_regpool_t *pool,
                                mybuf_region_t *region);
 
+/**
+ * Pools are not thread safe: all other routines must be called from the
+ * thread which uses the pool (its owner). Region memory may however be
+ * handed to other threads, e.g. to be written out by an I/O thread, provided
+ * the owner pins the region (or it was allocated separately) beforehand so
+ * that it cannot be relocated.
+ *
+ * Such a thread then calls free_region_remote() once it is done with the
+ * region. This only queues the region, without locks, for its owning pool;
+ * the owner unpins and frees the queued regions in one batch on its next
+ * call to get_region() or drain_remote().
+ *
+ * The queue relies on compiler atomics, so this routine is only provided
+ * (and MYBUF_HAVE_REMOTE_FREE defined) for GCC compatible compilers. See
+ * trace.h for the limits of tracing in threaded programs.
+ */
+#ifdef __GNUC__
+#define MYBUF_HAVE_REMOTE_FREE 1
+void mybuf_regpool_free_region_remote(mybuf_region_t *region);
+#endif
+
+/**
+ * Releases all regions queued by free_region_remote(). Called implicitly by
+ * get_region() and clean().
+ */
+void mybuf_regpool_drain_remote(mybuf_regpool_t *pool);
+
+
+/**
+ * Creates a new shared payload with a reference count of one.
+ * @param data the payload to copy in, or NULL to leave the contents
+ *  uninitialized so that the caller may fill in `->data` before the payload
+ *  is first queued
+ * @param ndata length of the payload
+ */
+mybuf_shared_t *mybuf_shared_new(const void *data, unsigned long ndata);
+
+/** Adds a reference to the payload */
+void mybuf_shared_ref(mybuf_shared_t *shared);
+
+/** Drops a reference, freeing the payload once no references remain */
+void mybuf_shared_unref(mybuf_shared_t *shared);
+
+/**
+ * Queues a shared payload into the pool. The pool takes its own reference
+ * which is dropped once the payload has been flushed via iov_done() or the
+ * pool is cleaned; the caller's reference is unaffected.
+ *
+ * The region is allocated and owned by the pool and must not be passed to
+ * free_region().
+ */
+void mybuf_regpool_add_shared(mybuf_regpool_t *pool, mybuf_shared_t *shared);
+
+/**
+ * Queues the same payload into each of 'npools' pools.
+ */
+void mybuf_shared_fanout(mybuf_shared_t *shared,
+                         mybuf_regpool_t **pools, unsigned int npools);
 
 /**
  * Get an IOV-like structure for outputting to the network buffers.
@@ -204,6 +477,21 @@ void mybuf_regpool_iov_get(mybuf_regpool_t *pool,
  */
 void mybuf_regpool_iov_done(mybuf_regpool_t *pool, unsigned long nused);
 
+/**
+ * Installs a hook which is passed the bytes acknowledged by each iov_done()
+ * (or dgram_done()) call, while they are still hot in the cache from having
+ * just been written out. The hook is called once per region, in queue
+ * order, with only the part of the region which was acknowledged; unlike
+ * iov_get(), adjacent regions are not merged. State kept in 'arg' (e.g. a
+ * running checksum, see crc32c.h) thus carries over correctly across
+ * partial writes.
+ *
+ * @param hook the hook, or NULL to remove it
+ * @param arg passed to the hook
+ */
+void mybuf_regpool_set_flush_hook(mybuf_regpool_t *pool,
+                                  mybuf_flush_hook_fn hook, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,323 @@
+#ifndef MYBUF_HPP
+#define MYBUF_HPP
+
+/**
+ * Header-only C++17 wrappers for the mybuf C structures.
+ *
+ * Buffers, pools and regions own their underlying C objects and release them
+ * on destruction. They are move-only; copying a buffer must be done
+ * explicitly via append().
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "mybuf.h"
+#include "trace.h"
+
+namespace mybuf {
+
+namespace detail {
+template <typename T>
+struct is_char_array : std::false_type {};
+
+/**
+ * Character arrays are most likely string literals, whose size includes the
+ * terminating NUL; these must be wrapped (e.g. in std::string_view)
+ */
+template <typename C, std::size_t N>
+struct is_char_array<C[N]>
+    : std::disjunction<std::is_same<std::remove_cv_t<C>, char>,
+                       std::is_same<std::remove_cv_t<C>, wchar_t>,
+                       std::is_same<std::remove_cv_t<C>, char16_t>,
+                       std::is_same<std::remove_cv_t<C>, char32_t>> {};
+
+template <typename T, typename = void>
+struct is_byte_view : std::false_type {};
+
+/** Anything with contiguous, trivially copyable std::data()/std::size() */
+template <typename T>
+struct is_byte_view<T, std::void_t<decltype(std::data(std::declval<const T &>())),
+                                   decltype(std::size(std::declval<const T &>()))>>
+    : std::conjunction<
+          std::negation<is_char_array<T>>,
+          std::is_trivially_copyable<std::remove_pointer_t<
+              decltype(std::data(std::declval<const T &>()))>>> {};
+
+template <typename T>
+std::size_t byte_size(const T &view) noexcept
+{
+    return std::size(view) * sizeof(*std::data(view));
+}
+} // namespace detail
+
+/**
+ * Contiguous buffer (mybuf_contig1_t). The first 'InlineBytes' bytes are
+ * stored within the object itself, so small buffers never allocate.
+ */
+template <std::size_t InlineBytes = 0>
+class contig {
+public:
+    contig() noexcept(InlineBytes > 0) { init(); }
+    ~contig() { mybuf_contig1_cleanup(&buf_); }
+
+    contig(const contig &) = delete;
+    contig &operator=(const contig &) = delete;
+
+    contig(contig &&other) noexcept { take(other); }
+
+    contig &operator=(contig &&other) noexcept
+    {
+        if (this != &other) {
+            mybuf_contig1_cleanup(&buf_);
+            take(other);
+        }
+        return *this;
+    }
+
+    const char *data() const noexcept { return MYBUF_CONTIG1_HEAD(&buf_); }
+    char *data() noexcept { return MYBUF_CONTIG1_HEAD(&buf_); }
+    std::size_t size() const noexcept { return buf_.length; }
+    bool empty() const noexcept { return buf_.length == 0; }
+    std::size_t capacity() const noexcept { return buf_.alloc; }
+
+    /** Whether the contents are still held in the inline storage */
+    bool is_inline() const noexcept
+    {
+        return (buf_.flags & MYBUF_CONTIG1_F_EXTERNAL) != 0;
+    }
+
+    /**
+     * Extends the buffer by 'n' bytes and returns a pointer to them. When
+     * the space is available this is a single inlined capacity check.
+     */
+    char *reserve(std::size_t n)
+    {
+        if (MYBUF_CONTIG1_SPACE(&buf_) >= n && !mybuf_trace_active &&
+                !mybuf_stats_enabled) {
+            return static_cast<char *>(MYBUF_CONTIG1_RESERVE_INPLACE(&buf_, n));
+        }
+        return static_cast<char *>(mybuf_contig1_reserve(&buf_, n));
+    }
+
+    void append(const void *src, std::size_t n)
+    {
+        fill(reserve(n), src, n);
+    }
+
+    /**
+     * Appends any number of contiguous views (std::string_view,
+     * std::vector, std::array, std::span...) with a single reservation.
+     * String literals are not accepted, as they would include their NUL.
+     */
+    template <typename... Views,
+              typename = std::enable_if_t<(detail::is_byte_view<Views>::value && ...)>>
+    void append(const Views &...views)
+    {
+        char *dst = reserve((detail::byte_size(views) + ... + 0));
+        ((fill(dst, std::data(views), detail::byte_size(views)),
+          dst += detail::byte_size(views)), ...);
+    }
+
+    void chop(std::size_t n) { mybuf_contig1_chop(&buf_, n); }
+    void compact() { mybuf_contig1_compact(&buf_); }
+
+    mybuf_contig1_t *get() noexcept { return &buf_; }
+    const mybuf_contig1_t *get() const noexcept { return &buf_; }
+
+private:
+    /** Large copies go through the library, which may bypass the cache */
+    static void fill(char *dst, const void *src, std::size_t n)
+    {
+        if (mybuf_settings.nt_threshold && n >= mybuf_settings.nt_threshold) {
+            mybuf_contig1_fill(dst, src, n);
+        } else {
+            std::memcpy(dst, src, n);
+        }
+    }
+
+    void init() noexcept(InlineBytes > 0)
+    {
+        if constexpr (InlineBytes > 0) {
+            mybuf_contig1_init_inline(&buf_, inline_, InlineBytes);
+        } else {
+            mybuf_contig1_init(&buf_);
+        }
+    }
+
+    void take(contig &other) noexcept
+    {
+        if (other.is_inline()) {
+            /** The bytes live inside 'other' and must be copied out */
+            std::size_t n = other.size();
+            mybuf_contig1_init_inline(&buf_, inline_, InlineBytes);
+            mybuf_contig1_append(&buf_, other.data(), n);
+            mybuf_contig1_chop(&other.buf_, n);
+            mybuf_contig1_compact(&other.buf_);
+        } else {
+            /** Leaves 'other' zeroed, which is valid and allocates on use */
+            mybuf_contig1_move(&buf_, &other.buf_);
+            if constexpr (InlineBytes > 0) {
+                mybuf_contig1_init_inline(&other.buf_, other.inline_, InlineBytes);
+            }
+        }
+    }
+
+    mybuf_contig1_t buf_;
+    alignas(std::max_align_t) char inline_[InlineBytes ? InlineBytes : 1];
+};
+
+class regpool;
+
+/**
+ * Owning handle to a region within a regpool. The region is released when
+ * the handle is destroyed; handles must not outlive their pool.
+ */
+class region {
+public:
+    region() noexcept = default;
+    ~region() { reset(); }
+
+    region(const region &) = delete;
+    region &operator=(const region &) = delete;
+
+    region(region &&other) noexcept
+        : pool_(std::exchange(other.pool_, nullptr)),
+          region_(std::exchange(other.region_, nullptr)) {}
+
+    region &operator=(region &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            pool_ = std::exchange(other.pool_, nullptr);
+            region_ = std::exchange(other.region_, nullptr);
+        }
+        return *this;
+    }
+
+    explicit operator bool() const noexcept { return region_ != nullptr; }
+
+    /** May change when the pool is resized, unless the region is pinned */
+    char *data() const noexcept { return region_->buf; }
+    std::size_t size() const noexcept { return region_->length; }
+
+    bool flushed() const noexcept
+    {
+        return (region_->flags & MYBUF_REGION_F_FLUSHED) != 0;
+    }
+
+    void pin() { mybuf_regpool_pin(pool_, region_); }
+    void unpin() { mybuf_regpool_unpin(pool_, region_); }
+
+    void set_priority(unsigned long priority)
+    {
+        mybuf_regpool_set_priority(pool_, region_, priority);
+    }
+
+    /** Frees the region (unpinning it first if needed) */
+    void reset() noexcept
+    {
+        if (!region_) {
+            return;
+        }
+        if (region_->flags & MYBUF_REGION_F_PINNED) {
+            mybuf_regpool_unpin(pool_, region_);
+        }
+        mybuf_regpool_free_region(pool_, region_);
+        pool_ = nullptr;
+        region_ = nullptr;
+    }
+
+#ifdef MYBUF_HAVE_REMOTE_FREE
+    /**
+     * Frees the region from a thread other than the pool's owner; see
+     * mybuf_regpool_free_region_remote()
+     */
+    void reset_remote() noexcept
+    {
+        if (region_) {
+            mybuf_regpool_free_region_remote(region_);
+            pool_ = nullptr;
+            region_ = nullptr;
+        }
+    }
+#endif
+
+    mybuf_region_t *get() const noexcept { return region_; }
+
+private:
+    friend class regpool;
+    region(mybuf_regpool_t *pool, mybuf_region_t *reg) noexcept
+        : pool_(pool), region_(reg) {}
+
+    mybuf_regpool_t *pool_ = nullptr;
+    mybuf_region_t *region_ = nullptr;
+};
+
+/**
+ * Region pool (mybuf_regpool_t). The C structure is self-referential, so it
+ * is kept on the heap and moving the pool only moves the pointer.
+ */
+class regpool {
+public:
+    regpool() : pool_(new mybuf_regpool_t) { mybuf_regpool_init(pool_.get()); }
+
+    regpool(regpool &&) noexcept = default;
+    regpool &operator=(regpool &&) noexcept = default;
+
+    region get_region(std::size_t n)
+    {
+        mybuf_region_t *reg = nullptr;
+        mybuf_regpool_get_region(pool_.get(), n, &reg);
+        return region(pool_.get(), reg);
+    }
+
+    /** Obtains a region holding a copy of 'n' bytes at 'src' */
+    region copy_region(const void *src, std::size_t n)
+    {
+        region reg = get_region(n);
+        std::memcpy(reg.data(), src, n);
+        return reg;
+    }
+
+    void add_shared(mybuf_shared_t *shared)
+    {
+        mybuf_regpool_add_shared(pool_.get(), shared);
+    }
+
+    void iov_get(mybuf_generic_iov *iov, unsigned int niov)
+    {
+        mybuf_regpool_iov_get(pool_.get(), iov, niov);
+    }
+
+    void iov_done(std::size_t nused)
+    {
+        mybuf_regpool_iov_done(pool_.get(), nused);
+    }
+
+    void set_flush_hook(mybuf_flush_hook_fn hook, void *arg)
+    {
+        mybuf_regpool_set_flush_hook(pool_.get(), hook, arg);
+    }
+
+    mybuf_regpool_t *get() const noexcept { return pool_.get(); }
+
+private:
+    struct deleter {
+        void operator()(mybuf_regpool_t *pool) const noexcept
+        {
+            mybuf_regpool_clean(pool);
+            delete pool;
+        }
+    };
+
+    std::unique_ptr<mybuf_regpool_t, deleter> pool_;
+};
+
+} // namespace mybuf
+
+#endif /* MYBUF_HPP */
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mybuf.h"
+#include "trace.h"
+
+/**
+ * Replays a workload trace recorded via mybuf_trace_start() against a given
+ * buffer configuration and reports its cost.
+ */
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] TRACEFILE\n"
+            "  -i BYTES   initial buffer allocation (default %lu)\n"
+            "  -g PCT     growth percentage on resize (default %u)\n"
+            "  -c PCT     compact after chopping past PCT of the buffer "
+            "(default %u)\n"
+            "  -n BYTES   streaming copy threshold, 0 to disable "
+            "(default %lu)\n",
+            argv0, mybuf_settings.alloc_init, mybuf_settings.growth_pct,
+            mybuf_settings.compact_pct, mybuf_settings.nt_threshold);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int ii;
+    const char *path = NULL;
+    FILE *fp;
+    mybuf_replay_result_t res;
+
+    for (ii = 1; ii < argc; ii++) {
+        const char *arg = argv[ii];
+        if (arg[0] == '-' && arg[1] && arg[2] == '\0' && ii + 1 < argc) {
+            unsigned long val = strtoul(argv[++ii], NULL, 10);
+            switch (arg[1]) {
+            case 'i':
+                mybuf_settings.alloc_init = val;
+                break;
+            case 'g':
+                mybuf_settings.growth_pct = (unsigned int)val;
+                break;
+            case 'c':
+                mybuf_settings.compact_pct = (unsigned int)val;
+                break;
+            case 'n':
+                mybuf_settings.nt_threshold = val;
+                break;
+            default:
+                usage(argv[0]);
+            }
+        } else if (!path && arg[0] != '-') {
+            path = arg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (!path || !mybuf_settings.alloc_init || mybuf_settings.growth_pct <= 100) {
+        usage(argv[0]);
+    }
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    if (mybuf_trace_replay(fp, &res) != 0) {
+        fprintf(stderr, "%s: malformed trace (after %lu records)\n",
+                path, res.nrecords);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    fclose(fp);
+
+    printf("records:       %lu\n", res.nrecords);
+    printf("bytes copied:  %lu\n", mybuf_stats.bytes_copied);
+    printf("peak memory:   %lu\n", mybuf_stats.peak_bytes);
+    printf("allocations:   %lu\n", mybuf_stats.nallocs);
+    printf("wall time:     %lu usec\n", res.wall_usec);
+    printf("traced time:   %lu usec\n", res.traced_usec);
+    return 0;
+}
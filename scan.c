@@ -0,0 +1,133 @@
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Kernels return the offset of the first occurrence of 'c' within the first
+ * 'n' bytes of 'p', or 'n' if there is none.
+ */
+typedef unsigned long (*find_fn)(const char *p, unsigned long n, int c);
+
+static unsigned long
+find_scalar(const char *p, unsigned long n, int c)
+{
+    const char *r = memchr(p, c, n);
+    return r ? (unsigned long)(r - p) : n;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static unsigned long
+find_sse2(const char *p, unsigned long n, int c)
+{
+    unsigned long ii = 0;
+    __m128i needle = _mm_set1_epi8((char)c);
+
+    for (; ii + 16 <= n; ii += 16) {
+        __m128i hay = _mm_loadu_si128((const __m128i *)(p + ii));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(hay, needle));
+        if (mask) {
+            return ii + __builtin_ctz(mask);
+        }
+    }
+    return ii + find_scalar(p + ii, n - ii, c);
+}
+
+__attribute__((target("avx2")))
+static unsigned long
+find_avx2(const char *p, unsigned long n, int c)
+{
+    unsigned long ii = 0;
+    __m256i needle = _mm256_set1_epi8((char)c);
+
+    for (; ii + 32 <= n; ii += 32) {
+        __m256i hay = _mm256_loadu_si256((const __m256i *)(p + ii));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(hay, needle));
+        if (mask) {
+            return ii + __builtin_ctz(mask);
+        }
+    }
+    return ii + find_sse2(p + ii, n - ii, c);
+}
+#endif
+
+static unsigned long find_dispatch(const char *p, unsigned long n, int c);
+static find_fn find_impl = find_dispatch;
+
+/** Selects the best kernel on first use */
+static unsigned long
+find_dispatch(const char *p, unsigned long n, int c)
+{
+    find_impl = find_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_impl = find_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_impl = find_sse2;
+    }
+#endif
+    return find_impl(p, n, c);
+}
+
+void
+mybuf_scanner_init(mybuf_scanner_t *sc, mybuf_scan_mode_t mode, int delim)
+{
+    sc->mode = mode;
+    sc->delim = mode == MYBUF_SCAN_CRLF ? '\n' : (unsigned char)delim;
+    sc->start = 0;
+    sc->scanned = 0;
+}
+
+int
+mybuf_scanner_next(mybuf_scanner_t *sc, const mybuf_contig1_t *buf,
+                   mybuf_frame_t *frame)
+{
+    const char *head = MYBUF_CONTIG1_HEAD(buf);
+
+    while (sc->scanned < buf->length) {
+        unsigned long pos = sc->scanned +
+                find_impl(head + sc->scanned, buf->length - sc->scanned,
+                          sc->delim);
+        unsigned long dlen = 1;
+
+        if (pos == buf->length) {
+            sc->scanned = pos;
+            return 0;
+        }
+
+        sc->scanned = pos + 1;
+
+        if (sc->mode == MYBUF_SCAN_CRLF) {
+            if (pos == sc->start || head[pos - 1] != '\r') {
+                continue;
+            }
+            dlen = 2;
+        }
+
+        frame->data = head + sc->start;
+        frame->consumed = pos + 1 - sc->start;
+        frame->length = frame->consumed - dlen;
+        sc->start = sc->scanned;
+        return 1;
+    }
+
+    return 0;
+}
+
+void
+mybuf_scanner_chop(mybuf_scanner_t *sc, mybuf_contig1_t *buf)
+{
+    if (!sc->start) {
+        return;
+    }
+    mybuf_contig1_chop(buf, sc->start);
+    sc->scanned -= sc->start;
+    sc->start = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef MYBUF_SCAN_H
+#define MYBUF_SCAN_H
+
+#include "mybuf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Delimiter scanner for text protocols framed within a contig1 buffer.
+ *
+ * The scanner remembers how far the buffer has already been searched, so
+ * that after a partial read only the newly appended bytes are examined.
+ * Searching uses SSE2 or AVX2 where the CPU supports it, selected at
+ * runtime, with a portable fallback.
+ *
+ * Typical use:
+ *
+ *      mybuf_contig1_append(&buf, data, ndata);
+ *      while (mybuf_scanner_next(&sc, &buf, &frame)) {
+ *          handle(frame.data, frame.length);
+ *      }
+ *      mybuf_scanner_chop(&sc, &buf);
+ */
+
+typedef enum {
+    /** Frames are terminated by a single delimiter byte */
+    MYBUF_SCAN_BYTE = 0,
+
+    /** Frames are terminated by "\r\n". A bare "\n" is not a delimiter */
+    MYBUF_SCAN_CRLF
+} mybuf_scan_mode_t;
+
+typedef struct {
+    mybuf_scan_mode_t mode;
+
+    /** Delimiter, for MYBUF_SCAN_BYTE */
+    unsigned char delim;
+
+    /** Offset from the head of the buffer at which the next frame begins */
+    unsigned long start;
+
+    /** Offset from the head of the buffer up to which has been searched */
+    unsigned long scanned;
+} mybuf_scanner_t;
+
+/**
+ * A frame within the buffer. The view remains valid until the buffer is
+ * appended to or chopped.
+ */
+typedef struct {
+    /** Beginning of the frame */
+    const char *data;
+
+    /** Length of the frame, excluding the delimiter */
+    unsigned long length;
+
+    /** Length of the frame including its delimiter */
+    unsigned long consumed;
+} mybuf_frame_t;
+
+/**
+ * @param mode the framing to use
+ * @param delim the delimiter byte, for MYBUF_SCAN_BYTE; ignored otherwise
+ */
+void mybuf_scanner_init(mybuf_scanner_t *sc, mybuf_scan_mode_t mode,
+                        int delim);
+
+/**
+ * Locate the next complete frame in the buffer.
+ * @return 1 if a frame was found and 'frame' filled in, 0 if the remaining
+ *  data does not contain a delimiter.
+ */
+int mybuf_scanner_next(mybuf_scanner_t *sc, const mybuf_contig1_t *buf,
+                       mybuf_frame_t *frame);
+
+/**
+ * Chops all frames returned so far from the buffer. Frame views obtained
+ * earlier are no longer valid afterwards.
+ */
+void mybuf_scanner_chop(mybuf_scanner_t *sc, mybuf_contig1_t *buf);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* MYBUF_SCAN_H */
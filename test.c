@@ -4,6 +4,23 @@
 #include <string.h>
 
 #include "mybuf.h"
+#include "trace.h"
+#include "dgram.h"
+#include "scan.h"
+#include "crc32c.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#endif
 
 void test2(void)
 {
@@ -118,10 +135,674 @@ void test1(void)
     mybuf_contig1_cleanup(&mb);
 }
 
+void test4(void)
+{
+    FILE *fp = tmpfile();
+    mybuf_replay_result_t res;
+    mybuf_stats_t orig;
+    mybuf_regpool_t pool;
+    mybuf_region_t *region = NULL;
+    mybuf_generic_iov iov;
+
+    /** Counters are left alone unless enabled, e.g. by a trace */
+    orig = mybuf_stats;
+    test1();
+    assert(memcmp(&orig, &mybuf_stats, sizeof(orig)) == 0);
+
+    assert(fp);
+    assert(mybuf_trace_start(fp) == 0);
+    assert(mybuf_trace_start(fp) == -1);
+    assert(mybuf_stats_enabled);
+
+    memset(&mybuf_stats, 0, sizeof(mybuf_stats));
+    test1();
+
+    mybuf_regpool_init(&pool);
+    mybuf_regpool_get_region(&pool, 4000, &region);
+    mybuf_regpool_pin(&pool, region);
+    mybuf_regpool_iov_get(&pool, &iov, 1);
+    mybuf_regpool_iov_done(&pool, 4000);
+    mybuf_regpool_unpin(&pool, region);
+    mybuf_regpool_free_region(&pool, region);
+    mybuf_regpool_clean(&pool);
+
+    mybuf_trace_stop();
+    assert(!mybuf_stats_enabled);
+    orig = mybuf_stats;
+
+    /** Same configuration: the replay must incur the same costs */
+    rewind(fp);
+    assert(mybuf_trace_replay(fp, &res) == 0);
+    assert(res.nrecords == 10012);
+    assert(mybuf_stats.bytes_copied == orig.bytes_copied);
+    assert(mybuf_stats.peak_bytes == orig.peak_bytes);
+    assert(mybuf_stats.nallocs == orig.nallocs);
+    assert(mybuf_stats.cur_bytes == 0);
+
+    /** A larger initial allocation never needs to grow */
+    mybuf_settings.alloc_init = 16384;
+    rewind(fp);
+    assert(mybuf_trace_replay(fp, &res) == 0);
+    assert(mybuf_stats.nallocs == 3);
+    mybuf_settings.alloc_init = 1024;
+
+    fclose(fp);
+}
+
+/** Objects created before the trace started are described implicitly */
+void test12(void)
+{
+    FILE *fp = tmpfile();
+    char data[256] = { 0 };
+    mybuf_replay_result_t res;
+    mybuf_contig1_t mb;
+    mybuf_regpool_t pool, pending, promoted;
+    mybuf_region_t *regions[5] = { NULL }, *more[5] = { NULL };
+    mybuf_shared_t *shared;
+    mybuf_generic_iov iov[MYBUF_IOV_MAX + 1];
+    unsigned int ii;
+
+    mybuf_contig1_init(&mb);
+    mybuf_contig1_append(&mb, data, 100);
+    mybuf_contig1_chop(&mb, 10);
+
+    mybuf_regpool_init(&pool);
+    mybuf_regpool_get_region(&pool, 100, regions + 0);
+    mybuf_regpool_get_region(&pool, 200, regions + 1);
+    mybuf_regpool_iov_get(&pool, iov, MYBUF_IOV_MAX);
+    mybuf_regpool_iov_done(&pool, 150);
+    mybuf_regpool_get_region(&pool, 50, regions + 2);
+    mybuf_regpool_set_priority(&pool, regions[2], 1);
+    mybuf_regpool_get_region(&pool, 64, regions + 3);
+    mybuf_regpool_pin(&pool, regions[3]);
+    shared = mybuf_shared_new(data, sizeof(data));
+    mybuf_regpool_add_shared(&pool, shared);
+
+    /** An iov_get() is outstanding while a region waits in the heap */
+    mybuf_regpool_init(&pending);
+    mybuf_regpool_get_region(&pending, 100, more + 0);
+    mybuf_regpool_iov_get(&pending, iov, MYBUF_IOV_MAX);
+    mybuf_regpool_get_region(&pending, 10, more + 1);
+    mybuf_regpool_set_priority(&pending, more[1], 0);
+
+    /** A promoted region keeps its priority within the queue */
+    mybuf_regpool_init(&promoted);
+    mybuf_regpool_get_region(&promoted, 10, more + 2);
+    mybuf_regpool_set_priority(&promoted, more[2], 5);
+    mybuf_regpool_iov_get(&promoted, iov, MYBUF_IOV_MAX);
+    mybuf_regpool_iov_done(&promoted, 0);
+    mybuf_regpool_get_region(&promoted, 5, more + 3);
+
+    assert(fp);
+    assert(mybuf_trace_start(fp) == 0);
+
+    mybuf_regpool_iov_done(&pending, 100);
+    mybuf_regpool_set_priority(&pending, more[1], 1);
+    mybuf_regpool_iov_get(&pending, iov, MYBUF_IOV_MAX);
+    mybuf_regpool_iov_done(&pending, 10);
+    mybuf_regpool_free_region(&pending, more[0]);
+    mybuf_regpool_free_region(&pending, more[1]);
+    mybuf_regpool_clean(&pending);
+
+    /** Queued behind the promoted region, but ahead of the default one */
+    mybuf_regpool_get_region(&promoted, 20, more + 4);
+    mybuf_regpool_set_priority(&promoted, more[4], 6);
+    mybuf_regpool_iov_get(&promoted, iov, MYBUF_IOV_MAX);
+    assert(iov[0].iov_base == more[2]->buf);
+    mybuf_regpool_iov_done(&promoted, 10);
+    mybuf_regpool_set_priority(&promoted, more[4], 7);
+    mybuf_regpool_iov_get(&promoted, iov, MYBUF_IOV_MAX);
+    mybuf_regpool_iov_done(&promoted, 25);
+    for (ii = 2; ii < 5; ii++) {
+        assert(more[ii]->flags & MYBUF_REGION_F_FLUSHED);
+        mybuf_regpool_free_region(&promoted, more[ii]);
+    }
+    mybuf_regpool_clean(&promoted);
+
+    mybuf_regpool_get_region(&pool, 32, regions + 4);
+    mybuf_regpool_iov_get(&pool, iov, MYBUF_IOV_MAX);
+    mybuf_regpool_iov_done(&pool, 150 + 50 + 64 + sizeof(data) + 32);
+    mybuf_regpool_unpin(&pool, regions[3]);
+    for (ii = 0; ii < 5; ii++) {
+        assert(regions[ii]->flags & MYBUF_REGION_F_FLUSHED);
+        mybuf_regpool_free_region(&pool, regions[ii]);
+    }
+    mybuf_shared_unref(shared);
+    mybuf_regpool_clean(&pool);
+
+    mybuf_contig1_chop(&mb, 90);
+    mybuf_contig1_cleanup(&mb);
+
+    mybuf_trace_stop();
+
+    rewind(fp);
+    assert(mybuf_trace_replay(fp, &res) == 0);
+    assert(res.nrecords > 14);
+    assert(mybuf_stats.cur_bytes == 0);
+    fclose(fp);
+}
+
+void test5(void)
+{
+    unsigned int ii;
+    mybuf_regpool_t pools[3], *ppools[3];
+    mybuf_shared_t *shared;
+    mybuf_region_t *region = NULL;
+    mybuf_generic_iov iov[2];
+
+    for (ii = 0; ii < 3; ii++) {
+        mybuf_regpool_init(pools + ii);
+        ppools[ii] = pools + ii;
+    }
+
+    shared = mybuf_shared_new("Hello World", 11);
+    assert(shared->refcount == 1);
+    mybuf_shared_fanout(shared, ppools, 3);
+    assert(shared->refcount == 4);
+
+    /** Shared bytes are referenced, not copied */
+    mybuf_regpool_iov_get(pools + 0, iov, 1);
+    assert(iov[0].iov_base == shared->data);
+    assert(iov[0].iov_len == 11);
+    mybuf_regpool_iov_done(pools + 0, 5);
+    mybuf_regpool_iov_get(pools + 0, iov, 1);
+    assert(iov[0].iov_base == shared->data + 5);
+    mybuf_regpool_iov_done(pools + 0, 6);
+    assert(shared->refcount == 3);
+
+    /** Shared regions are never relocated when the pool grows */
+    mybuf_regpool_get_region(pools + 1, 4096, &region);
+    mybuf_regpool_iov_get(pools + 1, iov, 2);
+    assert(iov[0].iov_base == shared->data);
+    assert(iov[1].iov_base == region->buf);
+    mybuf_regpool_iov_done(pools + 1, 11 + 4096);
+    assert(shared->refcount == 2);
+    mybuf_regpool_free_region(pools + 1, region);
+
+    mybuf_shared_unref(shared);
+    assert(shared->refcount == 1);
+
+    /** The last pool releases it */
+    for (ii = 0; ii < 3; ii++) {
+        mybuf_regpool_clean(pools + ii);
+    }
+
+    /** Empty payloads are released along with the bytes around them */
+    mybuf_regpool_init(pools + 0);
+    shared = mybuf_shared_new(NULL, 0);
+    mybuf_regpool_add_shared(pools + 0, shared);
+    region = NULL;
+    mybuf_regpool_get_region(pools + 0, 4, &region);
+    mybuf_regpool_add_shared(pools + 0, shared);
+    assert(shared->refcount == 3);
+    mybuf_regpool_iov_get(pools + 0, iov, 1);
+    mybuf_regpool_iov_done(pools + 0, 4);
+    assert(shared->refcount == 1);
+    assert(LCB_LIST_IS_EMPTY(&pools[0].regions.ll));
+    mybuf_regpool_free_region(pools + 0, region);
+    mybuf_shared_unref(shared);
+    mybuf_regpool_clean(pools + 0);
+}
+
+#ifdef __linux__
+static void
+dgram_sockets(int *tx, int *rx)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    *rx = socket(AF_INET, SOCK_DGRAM, 0);
+    *tx = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(*rx >= 0 && *tx >= 0);
+    assert(bind(*rx, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(getsockname(*rx, (struct sockaddr *)&addr, &addrlen) == 0);
+    assert(connect(*tx, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+}
+
+void test6(void)
+{
+    static const unsigned long sizes[] = { 100, 100, 100, 7, 300, 300, 1 };
+    /** Without GSO, with the limit taken from the path MTU, and below it */
+    static const struct {
+        int options;
+        unsigned int gso_size;
+    } modes[] = {
+        { 0, 0 }, { MYBUF_DGRAM_F_GSO, 0 }, { MYBUF_DGRAM_F_GSO, 200 }
+    };
+    unsigned int ii, mode, nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    int options, gso_size = 0, have_gso, tx, rx, rv;
+    char rbuf[512];
+    mybuf_regpool_t pool;
+    mybuf_region_t *regions[sizeof(sizes) / sizeof(sizes[0])];
+    mybuf_generic_iov iov[MYBUF_IOV_MAX];
+
+    dgram_sockets(&tx, &rx);
+
+    /** Probe once; a size of 0 leaves segmentation off by default */
+    have_gso = setsockopt(tx, IPPROTO_UDP, UDP_SEGMENT,
+                          &gso_size, sizeof(gso_size)) == 0;
+
+    for (mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++) {
+        options = modes[mode].options;
+        if ((options & MYBUF_DGRAM_F_GSO) && !have_gso) {
+            continue;
+        }
+
+        mybuf_regpool_init(&pool);
+        for (ii = 0; ii < nsizes; ii++) {
+            regions[ii] = NULL;
+            mybuf_regpool_get_region(&pool, sizes[ii], regions + ii);
+            memset(regions[ii]->buf, 'a' + ii, sizes[ii]);
+        }
+
+        /** Boundaries are kept even though the regions are contiguous */
+        assert(mybuf_regpool_dgram_get(&pool, iov, MYBUF_IOV_MAX) == nsizes);
+        assert(iov[1].iov_len == 100);
+        mybuf_regpool_dgram_done(&pool, 0);
+
+        rv = mybuf_regpool_sendmmsg(&pool, tx, NULL, 0, options,
+                                    modes[mode].gso_size);
+        assert(rv == (int)nsizes);
+        for (ii = 0; ii < nsizes; ii++) {
+            ssize_t nr = recv(rx, rbuf, sizeof(rbuf), 0);
+            assert(nr == (ssize_t)sizes[ii]);
+            assert(rbuf[0] == (char)('a' + ii));
+            assert(rbuf[nr - 1] == (char)('a' + ii));
+        }
+
+        assert(LCB_LIST_IS_EMPTY(&pool.regions.ll));
+        assert(pool.pinned == 0);
+        assert(mybuf_regpool_sendmmsg(&pool, tx, NULL, 0, options,
+                                      modes[mode].gso_size) == 0);
+
+        for (ii = 0; ii < nsizes; ii++) {
+            assert(regions[ii]->flags & MYBUF_REGION_F_FLUSHED);
+            mybuf_regpool_free_region(&pool, regions[ii]);
+        }
+        mybuf_regpool_clean(&pool);
+    }
+
+    close(tx);
+    close(rx);
+}
+#endif
+
+void test7(void)
+{
+    unsigned int ii, chunk, nframes;
+    char input[4096];
+    unsigned long lens[4096], expected;
+    mybuf_contig1_t mb;
+    mybuf_scanner_t sc;
+    mybuf_frame_t frame;
+
+    /** Frames of varying length so delimiters straddle vector boundaries */
+    for (ii = 0, nframes = 0, expected = 0; ii < sizeof(input); ii++) {
+        if (ii % 97 == 0 || ii % 13 == 5) {
+            input[ii] = '\n';
+            lens[nframes++] = expected;
+            expected = 0;
+        } else {
+            input[ii] = 'x';
+            expected++;
+        }
+    }
+
+    for (chunk = 1; chunk < 80; chunk += 7) {
+        unsigned int nseen = 0;
+        mybuf_contig1_init(&mb);
+        mybuf_scanner_init(&sc, MYBUF_SCAN_BYTE, '\n');
+
+        for (ii = 0; ii < sizeof(input); ii += chunk) {
+            unsigned int n = sizeof(input) - ii < chunk ?
+                    sizeof(input) - ii : chunk;
+            mybuf_contig1_append(&mb, input + ii, n);
+            while (mybuf_scanner_next(&sc, &mb, &frame)) {
+                assert(nseen < nframes);
+                assert(frame.length == lens[nseen]);
+                assert(frame.consumed == lens[nseen] + 1);
+                assert(frame.data[frame.length] == '\n');
+                assert(frame.length == 0 || frame.data[0] == 'x');
+                nseen++;
+            }
+            mybuf_scanner_chop(&sc, &mb);
+        }
+
+        assert(nseen == nframes);
+        assert(mb.length == expected);
+        mybuf_contig1_cleanup(&mb);
+    }
+
+    /** CRLF: a bare LF is part of the frame, and CR/LF may arrive apart */
+    mybuf_contig1_init(&mb);
+    mybuf_scanner_init(&sc, MYBUF_SCAN_CRLF, 0);
+    mybuf_contig1_append(&mb, "GET /\n\r", 7);
+    assert(mybuf_scanner_next(&sc, &mb, &frame) == 0);
+    mybuf_contig1_append(&mb, "\n\r\nrest", 7);
+    assert(mybuf_scanner_next(&sc, &mb, &frame) == 1);
+    assert(frame.length == 6);
+    assert(memcmp(frame.data, "GET /\n", 6) == 0);
+    assert(frame.consumed == 8);
+    assert(mybuf_scanner_next(&sc, &mb, &frame) == 1);
+    assert(frame.length == 0);
+    assert(mybuf_scanner_next(&sc, &mb, &frame) == 0);
+    mybuf_scanner_chop(&sc, &mb);
+    assert(mb.length == 4);
+    assert(memcmp(MYBUF_CONTIG1_HEAD(&mb), "rest", 4) == 0);
+    mybuf_contig1_cleanup(&mb);
+}
+
+void test8(void)
+{
+    unsigned int ii, crc = 0, expected = 0;
+    unsigned long left = 0;
+    mybuf_regpool_t pool;
+    mybuf_region_t *regions[5] = { NULL };
+    mybuf_shared_t *shared;
+    mybuf_generic_iov iov[MYBUF_IOV_MAX];
+
+    assert(mybuf_crc32c(0, "123456789", 9) == 0xe3069283U);
+    assert(mybuf_crc32c(mybuf_crc32c(0, "1234", 4), "56789", 5) ==
+            0xe3069283U);
+
+    mybuf_regpool_init(&pool);
+    mybuf_regpool_set_flush_hook(&pool, mybuf_crc32c_hook, &crc);
+
+    for (ii = 0; ii < 5; ii++) {
+        regions[ii] = NULL;
+        mybuf_regpool_get_region(&pool, 1000 + ii * 333, regions + ii);
+        memset(regions[ii]->buf, 'a' + ii, regions[ii]->length);
+        expected = mybuf_crc32c(expected, regions[ii]->buf,
+                                regions[ii]->length);
+        left += regions[ii]->length;
+        if (ii == 2) {
+            /** A hole: shared bytes live outside the pool's buffer */
+            shared = mybuf_shared_new("shared", 6);
+            mybuf_regpool_add_shared(&pool, shared);
+            expected = mybuf_crc32c(expected, "shared", 6);
+            left += 6;
+            mybuf_shared_unref(shared);
+        }
+    }
+
+    /** Odd sized partial writes, splitting regions */
+    while (left) {
+        unsigned long nused = left < 777 ? left : 777;
+        mybuf_regpool_iov_get(&pool, iov, MYBUF_IOV_MAX);
+        mybuf_regpool_iov_done(&pool, nused);
+        left -= nused;
+    }
+    assert(crc == expected);
+
+    for (ii = 0; ii < 5; ii++) {
+        mybuf_regpool_free_region(&pool, regions[ii]);
+    }
+
+    /** Datagram flushes feed the hook too */
+    crc = 0;
+    regions[0] = NULL;
+    mybuf_regpool_get_region(&pool, 100, regions);
+    memset(regions[0]->buf, 'z', 100);
+    mybuf_regpool_dgram_get(&pool, iov, MYBUF_IOV_MAX);
+    mybuf_regpool_dgram_done(&pool, 1);
+    assert(crc == mybuf_crc32c(0, regions[0]->buf, 100));
+    mybuf_regpool_free_region(&pool, regions[0]);
+
+    mybuf_regpool_clean(&pool);
+}
+
+typedef struct {
+    lcb_heap_node_t hn;
+    unsigned int key;
+} heap_item_t;
+
+static int heap_item_cmp(lcb_heap_node_t *a, lcb_heap_node_t *b)
+{
+    unsigned int ka = LCB_HEAP_ITEM(a, heap_item_t, hn)->key;
+    unsigned int kb = LCB_HEAP_ITEM(b, heap_item_t, hn)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+static void heap_item_count(lcb_heap_node_t *hn, void *arg)
+{
+    (void)hn;
+    (*(unsigned int *)arg)++;
+}
+
+void test9(void)
+{
+    unsigned int ii, last = 0, count = 0;
+    heap_item_t items[1000];
+    lcb_heap_t heap;
+    lcb_heap_node_t *hn;
+    mybuf_regpool_t pool;
+    mybuf_region_t *regions[4], *big;
+    mybuf_generic_iov iov[MYBUF_IOV_MAX];
+    const char *expected = "CDAB";
+
+    lcb_heap_init(&heap, heap_item_cmp);
+    assert(LCB_HEAP_IS_EMPTY(&heap));
+
+    for (ii = 0; ii < 1000; ii++) {
+        items[ii].key = (ii * 7919) % 1000;
+        lcb_heap_push(&heap, &items[ii].hn);
+    }
+
+    /** Pop key 0 (items[0]), then remove every third remaining item */
+    lcb_heap_pop(&heap);
+    for (ii = 0; ii < 1000; ii += 3) {
+        if (items[ii].key != 0) {
+            lcb_heap_delete(&heap, &items[ii].hn);
+        }
+    }
+
+    lcb_heap_walk(&heap, heap_item_count, &count);
+    assert(count == 1000 - 1 - 333);
+
+    while ((hn = lcb_heap_pop(&heap)) != NULL) {
+        unsigned int key = LCB_HEAP_ITEM(hn, heap_item_t, hn)->key;
+        assert(key > last);
+        last = key;
+        count--;
+    }
+    assert(count == 0);
+
+    /** Regions are flushed by priority, ties in insertion order */
+    mybuf_regpool_init(&pool);
+    for (ii = 0; ii < 4; ii++) {
+        regions[ii] = NULL;
+        mybuf_regpool_get_region(&pool, 1, regions + ii);
+        regions[ii]->buf[0] = 'A' + ii;
+    }
+    mybuf_regpool_set_priority(&pool, regions[0], 5);
+    mybuf_regpool_set_priority(&pool, regions[1], 5);
+    mybuf_regpool_set_priority(&pool, regions[3], 1);
+    mybuf_regpool_set_priority(&pool, regions[2], 0);
+
+    /** Force relocation while regions are waiting in the heap */
+    big = NULL;
+    mybuf_regpool_get_region(&pool, 8192, &big);
+    mybuf_regpool_free_region(&pool, big);
+
+    for (ii = 0; ii < 4; ii++) {
+        mybuf_regpool_dgram_get(&pool, iov, 1);
+        assert(*(char *)iov[0].iov_base == expected[ii]);
+        mybuf_regpool_dgram_done(&pool, 1);
+    }
+
+    for (ii = 0; ii < 4; ii++) {
+        mybuf_regpool_free_region(&pool, regions[ii]);
+    }
+
+    /**
+     * Against regions without a priority (MYBUF_REGION_PRIO_DEFAULT): lower
+     * values overtake them, higher values wait behind them
+     */
+    expected = "BADC";
+    for (ii = 0; ii < 4; ii++) {
+        regions[ii] = NULL;
+        mybuf_regpool_get_region(&pool, 1, regions + ii);
+        regions[ii]->buf[0] = 'A' + ii;
+        if (ii == 1) {
+            mybuf_regpool_set_priority(&pool, regions[ii], 0);
+        } else if (ii == 2) {
+            mybuf_regpool_set_priority(&pool, regions[ii],
+                                       MYBUF_REGION_PRIO_DEFAULT + 1);
+        }
+    }
+    for (ii = 0; ii < 4; ii++) {
+        mybuf_regpool_dgram_get(&pool, iov, 1);
+        assert(*(char *)iov[0].iov_base == expected[ii]);
+        mybuf_regpool_dgram_done(&pool, 1);
+    }
+    for (ii = 0; ii < 4; ii++) {
+        mybuf_regpool_free_region(&pool, regions[ii]);
+    }
+
+    /** A partially flushed region is never overtaken */
+    regions[0] = regions[1] = NULL;
+    mybuf_regpool_get_region(&pool, 2, regions + 0);
+    mybuf_regpool_iov_get(&pool, iov, 1);
+    mybuf_regpool_iov_done(&pool, 1);
+    mybuf_regpool_get_region(&pool, 1, regions + 1);
+    mybuf_regpool_set_priority(&pool, regions[1], 0);
+    mybuf_regpool_dgram_get(&pool, iov, 2);
+    assert(iov[0].iov_base == regions[0]->buf + 1);
+    assert(iov[1].iov_base == regions[1]->buf);
+    mybuf_regpool_dgram_done(&pool, 2);
+    mybuf_regpool_free_region(&pool, regions[0]);
+    mybuf_regpool_free_region(&pool, regions[1]);
+
+    mybuf_regpool_clean(&pool);
+}
+
+void test10(void)
+{
+    unsigned int ii, off;
+    unsigned long threshold = mybuf_settings.nt_threshold;
+    char src[4096];
+    mybuf_contig1_t mb;
+
+    for (ii = 0; ii < sizeof(src); ii++) {
+        src[ii] = (char)(ii * 31 + 7);
+    }
+
+    /** Exercise streaming copies at every alignment, and overlapping moves */
+    mybuf_settings.nt_threshold = 1;
+    for (off = 0; off < 17; off++) {
+        mybuf_contig1_init(&mb);
+        mybuf_contig1_append(&mb, "0123456789abcdef", off);
+        mybuf_contig1_append(&mb, src, sizeof(src) - off);
+        assert(memcmp(MYBUF_CONTIG1_HEAD(&mb) + off, src,
+                      sizeof(src) - off) == 0);
+
+        mybuf_contig1_chop(&mb, off + 5);
+        mybuf_contig1_compact(&mb);
+        assert(mb.start_offset == 0);
+        assert(memcmp(mb.data, src + 5, sizeof(src) - off - 5) == 0);
+
+        /** Reserved space filled by the caller */
+        mybuf_contig1_fill(mybuf_contig1_reserve(&mb, sizeof(src) - off),
+                           src + off, sizeof(src) - off);
+        assert(memcmp(MYBUF_CONTIG1_TAIL(&mb) - (sizeof(src) - off),
+                      src + off, sizeof(src) - off) == 0);
+        mybuf_contig1_cleanup(&mb);
+    }
+    mybuf_settings.nt_threshold = threshold;
+}
+
+#if defined(__linux__) && defined(MYBUF_HAVE_REMOTE_FREE)
+#define REMOTE_NREGIONS 1000
+
+typedef struct {
+    mybuf_region_t **regions;
+    unsigned int begin;
+} remote_arg_t;
+
+static void *
+remote_free_thread(void *arg)
+{
+    remote_arg_t *ra = arg;
+    unsigned int ii;
+    for (ii = ra->begin; ii < REMOTE_NREGIONS; ii += 2) {
+        assert(ra->regions[ii]->buf[0] == (char)ii);
+        mybuf_regpool_free_region_remote(ra->regions[ii]);
+    }
+    return NULL;
+}
+
+void test11(void)
+{
+    unsigned int ii;
+    unsigned long nallocs;
+    mybuf_regpool_t pool;
+    mybuf_region_t *regions[REMOTE_NREGIONS], *region;
+    remote_arg_t args[2];
+    pthread_t thr[2];
+
+    mybuf_regpool_init(&pool);
+    for (ii = 0; ii < REMOTE_NREGIONS; ii++) {
+        regions[ii] = NULL;
+        mybuf_regpool_get_region(&pool, 64, regions + ii);
+        regions[ii]->buf[0] = (char)ii;
+        /** Pinned before being handed off, so it cannot move */
+        mybuf_regpool_pin(&pool, regions[ii]);
+    }
+
+    /** Two threads free concurrently into the same pool */
+    for (ii = 0; ii < 2; ii++) {
+        args[ii].regions = regions;
+        args[ii].begin = ii;
+        assert(pthread_create(thr + ii, NULL, remote_free_thread,
+                              args + ii) == 0);
+    }
+    for (ii = 0; ii < 2; ii++) {
+        pthread_join(thr[ii], NULL);
+    }
+
+    /** Remotely freed regions are released on the owner's next allocation */
+    assert(pool.pinned > 0);
+    mybuf_stats_enabled = 1;
+    nallocs = mybuf_stats.nallocs;
+    region = NULL;
+    mybuf_regpool_get_region(&pool, 64, &region);
+    assert(pool.remote_frees == NULL);
+    assert(pool.pinned == 0);
+    assert(region->pool == &pool);
+
+    /** ... and their descriptors are reused without allocating */
+    assert(pool.ndesc_cache == MYBUF_REGPOOL_DESC_CACHE - 1);
+    assert(mybuf_stats.nallocs == nallocs);
+    mybuf_stats_enabled = 0;
+    assert(pool.regions.ll.next == &region->ll);
+    assert(pool.regions.ll.prev == &region->ll);
+
+    mybuf_regpool_free_region_remote(region);
+    mybuf_regpool_clean(&pool);
+}
+#endif
+
 int main(void)
 {
     test1();
     test2();
     test3();
+    test4();
+    test5();
+    test7();
+    test8();
+    test9();
+    test10();
+    test12();
+#ifdef __linux__
+    test6();
+#ifdef MYBUF_HAVE_REMOTE_FREE
+    test11();
+#endif
+#endif
     return 0;
 }
@@ -0,0 +1,139 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mybuf.hpp"
+
+static void test_contig()
+{
+    mybuf::contig<64> small;
+    std::string_view hello("Hello ");
+    std::array<char, 5> world = {{ 'W', 'o', 'r', 'l', 'd' }};
+    mybuf_stats_enabled = 1;
+    unsigned long nallocs = mybuf_stats.nallocs;
+
+    small.append(hello, world);
+    assert(small.size() == 11);
+    assert(std::memcmp(small.data(), "Hello World", 11) == 0);
+    assert(small.is_inline());
+    assert(mybuf_stats.nallocs == nallocs);
+
+    /** Moving an inline buffer copies the bytes out */
+    mybuf::contig<64> moved(std::move(small));
+    assert(small.empty());
+    assert(moved.is_inline());
+    assert(std::memcmp(moved.data(), "Hello World", 11) == 0);
+
+    /** Spilling to the heap keeps the contents, and moves steal it */
+    std::vector<char> big(100, 'x');
+    moved.append(big);
+    assert(!moved.is_inline());
+    assert(moved.size() == 111);
+    assert(mybuf_stats.nallocs == nallocs + 1);
+    mybuf_stats_enabled = 0;
+
+    const char *heap = moved.data();
+    small = std::move(moved);
+    assert(small.data() == heap);
+    assert(moved.is_inline() && moved.empty());
+
+    small.chop(6);
+    assert(std::memcmp(small.data(), "World", 5) == 0);
+
+    /** Literals must be wrapped, so that their NUL is not appended */
+    static_assert(!mybuf::detail::is_byte_view<char[4]>::value);
+    static_assert(!mybuf::detail::is_byte_view<const char *>::value);
+    static_assert(mybuf::detail::is_byte_view<unsigned char[4]>::value);
+    std::size_t before = small.size();
+    small.append(std::string_view("abc"));
+    assert(small.size() == before + 3);
+    assert(std::memcmp(small.data() + before, "abc", 3) == 0);
+
+    /** Copies above the streaming threshold go through the library */
+    unsigned long threshold = mybuf_settings.nt_threshold;
+    mybuf_settings.nt_threshold = 64;
+    std::vector<char> large(1000);
+    for (std::size_t ii = 0; ii < large.size(); ii++) {
+        large[ii] = static_cast<char>(ii * 31);
+    }
+    before = small.size();
+    small.append(large, hello);
+    small.append(large.data() + 1, 999);
+    assert(std::memcmp(small.data() + before, large.data(), 1000) == 0);
+    assert(std::memcmp(small.data() + before + 1006, large.data() + 1, 999) == 0);
+    mybuf_settings.nt_threshold = threshold;
+
+    mybuf::contig<> plain;
+    plain.append("abc", 3);
+    mybuf::contig<> plain2 = std::move(plain);
+    plain.append("def", 3);
+    assert(plain.size() == 3);
+    assert(plain2.size() == 3);
+}
+
+static void test_regpool()
+{
+    mybuf::regpool pool;
+    mybuf_generic_iov iov;
+
+    mybuf::region reg = pool.copy_region("abc", 3);
+    assert(reg && reg.size() == 3);
+    reg.pin();
+
+    mybuf::regpool moved(std::move(pool));
+    moved.iov_get(&iov, 1);
+    assert(iov.iov_base == reg.data());
+    assert(iov.iov_len == 3);
+    moved.iov_done(3);
+    assert(reg.flushed());
+
+    mybuf::region other(std::move(reg));
+    assert(!reg);
+    other.reset();
+    assert(!other);
+}
+
+/** Buffers moved while a trace is recorded keep their identity */
+static void test_trace_moves()
+{
+    std::FILE *fp = std::tmpfile();
+    mybuf_replay_result_t res;
+    std::vector<char> big(200, 'x');
+
+    assert(fp && mybuf_trace_start(fp) == 0);
+    {
+        mybuf::contig<16> a;
+        a.append(std::string_view("inline"));
+        mybuf::contig<16> b(std::move(a));
+        b.append(big);
+        a = std::move(b);
+        a.chop(100);
+        b.append(std::string_view("reused"));
+        b.chop(6);
+
+        mybuf::contig<> c;
+        c.append(big);
+        mybuf::contig<> d(std::move(c));
+        d.chop(200);
+        c.append(big);
+    }
+    mybuf_trace_stop();
+
+    std::rewind(fp);
+    assert(mybuf_trace_replay(fp, &res) == 0);
+    assert(res.nrecords > 0);
+    assert(mybuf_stats.cur_bytes == 0);
+    std::fclose(fp);
+}
+
+int main()
+{
+    test_contig();
+    test_regpool();
+    test_trace_moves();
+    return 0;
+}
@@ -0,0 +1,871 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#include "mybuf.h"
+#include "trace.h"
+#include "dgram.h"
+
+int mybuf_trace_active = 0;
+
+/**
+ * Maps object pointers to the small integer ids written into the trace.
+ * Open addressing with linear probing; the table is kept at most half full.
+ */
+typedef struct {
+    const void *key;
+    unsigned long id;
+} trace_slot_t;
+
+static struct {
+    FILE *fp;
+    struct timeval last;
+
+    /** Value of mybuf_stats_enabled to restore once the trace stops */
+    int stats_enabled;
+
+    trace_slot_t *slots;
+    unsigned long nslots;
+    unsigned long nkeys;
+
+    /** Ids released by destroyed objects, reused before allocating anew */
+    unsigned long *free_ids;
+    unsigned long nfree;
+    unsigned long free_alloc;
+    unsigned long next_id;
+} tracer;
+
+static unsigned long
+hash_ptr(const void *p)
+{
+    unsigned long h = (unsigned long)(size_t)p;
+    h ^= h >> 16;
+    h *= 0x45d9f3bUL;
+    h ^= h >> 16;
+    return h;
+}
+
+static trace_slot_t *
+slot_find(const void *key)
+{
+    unsigned long ix = hash_ptr(key) & (tracer.nslots - 1);
+    while (tracer.slots[ix].key && tracer.slots[ix].key != key) {
+        ix = (ix + 1) & (tracer.nslots - 1);
+    }
+    return tracer.slots + ix;
+}
+
+static void
+slot_grow(void)
+{
+    trace_slot_t *old = tracer.slots;
+    unsigned long ii, nold = tracer.nslots;
+
+    tracer.nslots = nold ? nold * 2 : 64;
+    tracer.slots = calloc(tracer.nslots, sizeof(*tracer.slots));
+    for (ii = 0; ii < nold; ii++) {
+        if (old[ii].key) {
+            *slot_find(old[ii].key) = old[ii];
+        }
+    }
+    free(old);
+}
+
+static unsigned long
+id_assign(const void *obj)
+{
+    trace_slot_t *slot;
+
+    if ((tracer.nkeys + 1) * 2 > tracer.nslots) {
+        slot_grow();
+    }
+
+    slot = slot_find(obj);
+    if (slot->key) {
+        /** Re-initialized without being destroyed; keep the old id */
+        return slot->id;
+    }
+
+    slot->key = obj;
+    slot->id = tracer.nfree ? tracer.free_ids[--tracer.nfree] : tracer.next_id++;
+    tracer.nkeys++;
+    return slot->id;
+}
+
+/** Removes the slot of 'obj', if any, returning its id or 0 */
+static unsigned long
+id_remove(const void *obj)
+{
+    trace_slot_t *slot;
+    unsigned long ix, next, id;
+
+    if (!tracer.nslots) {
+        return 0;
+    }
+
+    slot = slot_find(obj);
+    if (!slot->key) {
+        return 0;
+    }
+    id = slot->id;
+    tracer.nkeys--;
+
+    /** Backward-shift deletion so that probe sequences stay intact */
+    ix = slot - tracer.slots;
+    next = (ix + 1) & (tracer.nslots - 1);
+    while (tracer.slots[next].key) {
+        unsigned long home = hash_ptr(tracer.slots[next].key) &
+                (tracer.nslots - 1);
+        if (((next - home) & (tracer.nslots - 1)) >=
+                ((next - ix) & (tracer.nslots - 1))) {
+            tracer.slots[ix] = tracer.slots[next];
+            ix = next;
+        }
+        next = (next + 1) & (tracer.nslots - 1);
+    }
+    tracer.slots[ix].key = NULL;
+    return id;
+}
+
+static void
+id_release(const void *obj)
+{
+    unsigned long id = id_remove(obj);
+    if (!id) {
+        return;
+    }
+
+    if (tracer.nfree == tracer.free_alloc) {
+        tracer.free_alloc = tracer.free_alloc ? tracer.free_alloc * 2 : 64;
+        tracer.free_ids = realloc(tracer.free_ids,
+                                  tracer.free_alloc * sizeof(unsigned long));
+    }
+    tracer.free_ids[tracer.nfree++] = id;
+}
+
+/** Transfers the id of 'from' to 'to', which has moved there */
+static void
+id_move(const void *from, const void *to)
+{
+    unsigned long id = id_remove(from);
+    trace_slot_t *slot;
+
+    id_release(to);
+    if ((tracer.nkeys + 1) * 2 > tracer.nslots) {
+        slot_grow();
+    }
+    slot = slot_find(to);
+    slot->key = to;
+    slot->id = id;
+    tracer.nkeys++;
+}
+
+static void
+put_varint(FILE *fp, unsigned long val)
+{
+    while (val >= 0x80) {
+        putc((int)((val & 0x7f) | 0x80), fp);
+        val >>= 7;
+    }
+    putc((int)val, fp);
+}
+
+static int
+get_varint(FILE *fp, unsigned long *val)
+{
+    int c, shift = 0;
+    *val = 0;
+    do {
+        if ((c = getc(fp)) == EOF || shift >= (int)sizeof(*val) * 8) {
+            return -1;
+        }
+        *val |= (unsigned long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+static unsigned long
+usec_since(struct timeval *since, struct timeval *now)
+{
+    return (now->tv_sec - since->tv_sec) * 1000000UL +
+            now->tv_usec - since->tv_usec;
+}
+
+static void
+put_record(int op, unsigned long delta, unsigned long id, unsigned long arg)
+{
+    putc(op, tracer.fp);
+    put_varint(tracer.fp, delta);
+    put_varint(tracer.fp, id);
+    put_varint(tracer.fp, arg);
+}
+
+/**
+ * Objects created before the trace was started are first seen by some other
+ * operation. Their current state is then written out as a series of
+ * implicit records, with no elapsed time, from which the replayer recreates
+ * an equivalent object. The following routines return the id of an object,
+ * describing it first if it is not yet known.
+ */
+
+/** @return the id of 'obj', or 0 if it has none */
+static unsigned long
+id_known(const void *obj)
+{
+    trace_slot_t *slot;
+    if (!tracer.nslots) {
+        return 0;
+    }
+    slot = slot_find(obj);
+    return slot->key ? slot->id : 0;
+}
+
+static unsigned long
+contig1_id(const mybuf_contig1_t *buf)
+{
+    unsigned long id = id_known(buf);
+    if (id) {
+        return id;
+    }
+
+    id = id_assign(buf);
+    if (buf->flags & MYBUF_CONTIG1_F_EXTERNAL) {
+        put_record(MYBUF_TRACE_CONTIG1_INIT_INLINE, 0, id, buf->alloc);
+    } else {
+        put_record(MYBUF_TRACE_CONTIG1_INIT, 0, id, 0);
+    }
+    if (buf->length) {
+        put_record(MYBUF_TRACE_CONTIG1_APPEND, 0, id, buf->length);
+    }
+    return id;
+}
+
+static unsigned long
+shared_id(const mybuf_shared_t *shared)
+{
+    unsigned long ii, id = id_known(shared);
+    if (id) {
+        return id;
+    }
+
+    /**
+     * All references are attributed to the application; each pool which
+     * queues the payload hands one back as it is described (see below)
+     */
+    id = id_assign(shared);
+    put_record(MYBUF_TRACE_SHARED_NEW, 0, id, shared->length);
+    for (ii = 1; ii < shared->refcount; ii++) {
+        put_record(MYBUF_TRACE_SHARED_REF, 0, id, 0);
+    }
+    return id;
+}
+
+/** Describes a region obtained from the pool 'pool_id' */
+static void
+put_region(unsigned long pool_id, const mybuf_region_t *region)
+{
+    unsigned long id;
+
+    if (region->flags & MYBUF_REGION_F_SHARED) {
+        id = shared_id(region->shared);
+        put_record(MYBUF_TRACE_ADD_SHARED, 0, pool_id, 0);
+        put_varint(tracer.fp, id);
+        put_record(MYBUF_TRACE_SHARED_UNREF, 0, id, 0);
+        return;
+    }
+
+    id = id_assign(region);
+    put_record(MYBUF_TRACE_GET_REGION, 0, pool_id, region->length);
+    put_varint(tracer.fp, id);
+    if (region->flags & MYBUF_REGION_F_PINNED) {
+        put_record(MYBUF_TRACE_PIN, 0, id, 0);
+    }
+    if (region->flags & MYBUF_REGION_F_PRIORITIZED) {
+        put_record(MYBUF_TRACE_SET_PRIORITY, 0, id, region->priority);
+    }
+}
+
+typedef struct {
+    unsigned long pool_id;
+    const mybuf_region_t *except;
+    unsigned long npinned;
+} put_prio_arg_t;
+
+static void
+count_prio_pinned(lcb_heap_node_t *hn, void *arg)
+{
+    put_prio_arg_t *pa = arg;
+    mybuf_region_t *region = LCB_HEAP_ITEM(hn, mybuf_region_t, hn);
+    if (region != pa->except && (region->flags & MYBUF_REGION_F_PINNED)) {
+        pa->npinned++;
+    }
+}
+
+static void
+put_prio_region(lcb_heap_node_t *hn, void *arg)
+{
+    put_prio_arg_t *pa = arg;
+    mybuf_region_t *region = LCB_HEAP_ITEM(hn, mybuf_region_t, hn);
+    if (region != pa->except) {
+        put_region(pa->pool_id, region);
+    }
+}
+
+/** Flushes 'nused' bytes of the replayed pool, promoting its heap first */
+static void
+put_flush(unsigned long pool_id, unsigned long nused)
+{
+    put_record(MYBUF_TRACE_IOV_GET, 0, pool_id, 0);
+    put_record(MYBUF_TRACE_IOV_DONE, 0, pool_id, nused);
+}
+
+/**
+ * @param except a region which is not to be described, as it is the one
+ *  being created by the operation which is recorded
+ */
+static unsigned long
+regpool_id(mybuf_regpool_t *pool, const mybuf_region_t *except)
+{
+    lcb_list_t *ll;
+    put_prio_arg_t pa;
+    unsigned long nflushed = 0, id = id_known(pool);
+    int head = 1;
+
+    if (id) {
+        return id;
+    }
+
+    id = id_assign(pool);
+    put_record(MYBUF_TRACE_REGPOOL_INIT, 0, id, 0);
+
+    pa.pool_id = id;
+    pa.except = except;
+    pa.npinned = 0;
+
+    /** Flushed regions are queued and flushed again */
+    LCB_LIST_FOR(ll, &pool->flushed_regions.ll) {
+        mybuf_region_t *region = LCB_LIST_ITEM(ll, mybuf_region_t, ll);
+        nflushed += region->length;
+        pa.npinned += (region->flags & MYBUF_REGION_F_PINNED) != 0;
+        put_region(id, region);
+    }
+    if (nflushed) {
+        put_flush(id, nflushed);
+    }
+
+    LCB_LIST_FOR(ll, &pool->regions.ll) {
+        mybuf_region_t *region = LCB_LIST_ITEM(ll, mybuf_region_t, ll);
+        if (region == except) {
+            continue;
+        }
+        pa.npinned += (region->flags & MYBUF_REGION_F_PINNED) != 0;
+        put_region(id, region);
+
+        /**
+         * A region which was promoted from the heap keeps its priority, as
+         * later promotions are ordered against it. Every region queued
+         * ahead of it (bar a partially flushed head) has an equal or lower
+         * value, so promoting it again places it back at the tail.
+         */
+        if (region->priority != MYBUF_REGION_PRIO_DEFAULT &&
+                (region->flags & MYBUF_REGION_F_SHARED) == 0) {
+            put_record(MYBUF_TRACE_SET_PRIORITY, 0, id_known(region),
+                       region->priority);
+            put_flush(id, 0);
+        }
+        if (head && pool->flush_offset) {
+            put_flush(id, pool->flush_offset);
+        }
+        head = 0;
+    }
+
+    /**
+     * Any remaining pins are held by outstanding iov_get() calls. These are
+     * replayed before the heap is described, as they would promote it
+     */
+    lcb_heap_walk(&pool->prio_regions, count_prio_pinned, &pa);
+    for (; pa.npinned < (unsigned long)pool->pinned; pa.npinned++) {
+        put_record(MYBUF_TRACE_IOV_GET, 0, id, 0);
+    }
+
+    lcb_heap_walk(&pool->prio_regions, put_prio_region, &pa);
+    return id;
+}
+
+static unsigned long
+region_id(mybuf_region_t *region)
+{
+    unsigned long pool_id, id = id_known(region);
+    if (id) {
+        return id;
+    }
+
+    /** Describing the pool normally describes its regions as well */
+    pool_id = regpool_id(region->pool, NULL);
+    if ((id = id_known(region)) == 0) {
+        put_region(pool_id, region);
+        id = id_known(region);
+    }
+    return id;
+}
+
+int
+mybuf_trace_start(FILE *fp)
+{
+    if (mybuf_trace_active) {
+        return -1;
+    }
+
+    memset(&tracer, 0, sizeof(tracer));
+    tracer.fp = fp;
+    tracer.next_id = 1;
+    tracer.stats_enabled = mybuf_stats_enabled;
+    gettimeofday(&tracer.last, NULL);
+
+    fwrite(MYBUF_TRACE_MAGIC, 1, 4, fp);
+    putc(MYBUF_TRACE_VERSION, fp);
+    if (ferror(fp)) {
+        return -1;
+    }
+
+    mybuf_trace_active = 1;
+    mybuf_stats_enabled = 1;
+    return 0;
+}
+
+void
+mybuf_trace_stop(void)
+{
+    if (!mybuf_trace_active) {
+        return;
+    }
+    fflush(tracer.fp);
+    mybuf_stats_enabled = tracer.stats_enabled;
+    free(tracer.slots);
+    free(tracer.free_ids);
+    memset(&tracer, 0, sizeof(tracer));
+    mybuf_trace_active = 0;
+}
+
+void
+mybuf_trace_record(mybuf_trace_op_t op, const void *obj,
+                   unsigned long arg, const void *child)
+{
+    struct timeval now;
+    unsigned long id, child_id = 0;
+
+    gettimeofday(&now, NULL);
+
+    switch (op) {
+    case MYBUF_TRACE_CONTIG1_INIT:
+    case MYBUF_TRACE_CONTIG1_INIT_INLINE:
+    case MYBUF_TRACE_REGPOOL_INIT:
+    case MYBUF_TRACE_SHARED_NEW:
+        id = id_assign(obj);
+        break;
+    case MYBUF_TRACE_CONTIG1_CLEANUP:
+    case MYBUF_TRACE_CONTIG1_APPEND:
+    case MYBUF_TRACE_CONTIG1_COMPACT:
+    case MYBUF_TRACE_CONTIG1_CHOP:
+    case MYBUF_TRACE_CONTIG1_MOVE:
+        id = contig1_id(obj);
+        break;
+    case MYBUF_TRACE_GET_REGION:
+        id = regpool_id((mybuf_regpool_t *)obj, child);
+        child_id = id_assign(child);
+        break;
+    case MYBUF_TRACE_ADD_SHARED:
+        id = regpool_id((mybuf_regpool_t *)obj, NULL);
+        child_id = shared_id(child);
+        break;
+    case MYBUF_TRACE_PIN:
+    case MYBUF_TRACE_UNPIN:
+    case MYBUF_TRACE_FREE_REGION:
+    case MYBUF_TRACE_SET_PRIORITY:
+        id = region_id((mybuf_region_t *)obj);
+        break;
+    case MYBUF_TRACE_SHARED_REF:
+    case MYBUF_TRACE_SHARED_UNREF:
+    case MYBUF_TRACE_SHARED_FREE:
+        id = shared_id(obj);
+        break;
+    default:
+        id = regpool_id((mybuf_regpool_t *)obj, NULL);
+        break;
+    }
+
+    put_record(op, usec_since(&tracer.last, &now), id, arg);
+    if (op == MYBUF_TRACE_GET_REGION || op == MYBUF_TRACE_ADD_SHARED) {
+        put_varint(tracer.fp, child_id);
+    }
+    tracer.last = now;
+
+    switch (op) {
+    case MYBUF_TRACE_CONTIG1_CLEANUP:
+    case MYBUF_TRACE_REGPOOL_CLEAN:
+    case MYBUF_TRACE_FREE_REGION:
+    case MYBUF_TRACE_SHARED_FREE:
+        id_release(obj);
+        break;
+    case MYBUF_TRACE_CONTIG1_MOVE:
+        id_move(obj, child);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Replay side
+ */
+
+typedef enum {
+    REPLAY_NONE = 0,
+    REPLAY_CONTIG1,
+    REPLAY_REGPOOL,
+    REPLAY_REGION,
+    REPLAY_SHARED
+} replay_kind_t;
+
+typedef struct {
+    replay_kind_t kind;
+    void *obj;
+
+    /** Owning pool, for regions */
+    mybuf_regpool_t *pool;
+
+    /** References held by the application, for shared payloads */
+    unsigned long refs;
+
+    /** Stand-in for user-provided storage, for inline contig1 buffers */
+    void *storage;
+} replay_obj_t;
+
+typedef struct {
+    replay_obj_t *objs;
+    unsigned long nobjs;
+
+    /** Scratch payload used for appends */
+    char *scratch;
+    unsigned long nscratch;
+} replay_ctx_t;
+
+static replay_obj_t *
+replay_slot(replay_ctx_t *ctx, unsigned long id)
+{
+    if (id >= ctx->nobjs) {
+        unsigned long nobjs = ctx->nobjs ? ctx->nobjs : 64;
+        while (nobjs <= id) {
+            nobjs *= 2;
+        }
+        ctx->objs = realloc(ctx->objs, nobjs * sizeof(*ctx->objs));
+        memset(ctx->objs + ctx->nobjs, 0,
+               (nobjs - ctx->nobjs) * sizeof(*ctx->objs));
+        ctx->nobjs = nobjs;
+    }
+    return ctx->objs + id;
+}
+
+static replay_obj_t *
+replay_get(replay_ctx_t *ctx, unsigned long id, replay_kind_t kind)
+{
+    if (id >= ctx->nobjs || ctx->objs[id].kind != kind) {
+        return NULL;
+    }
+    return ctx->objs + id;
+}
+
+static int
+replay_one(replay_ctx_t *ctx, int op, unsigned long id,
+           unsigned long arg, unsigned long child)
+{
+    replay_obj_t *ent;
+    mybuf_generic_iov iov[MYBUF_IOV_MAX + 1];
+
+    switch (op) {
+    case MYBUF_TRACE_CONTIG1_INIT:
+        ent = replay_slot(ctx, id);
+        if (ent->kind != REPLAY_NONE) {
+            return -1;
+        }
+        ent->kind = REPLAY_CONTIG1;
+        ent->obj = malloc(sizeof(mybuf_contig1_t));
+        mybuf_contig1_init(ent->obj);
+        return 0;
+
+    case MYBUF_TRACE_CONTIG1_INIT_INLINE:
+        ent = replay_slot(ctx, id);
+        if (ent->kind != REPLAY_NONE) {
+            return -1;
+        }
+        ent->kind = REPLAY_CONTIG1;
+        ent->obj = malloc(sizeof(mybuf_contig1_t));
+        ent->storage = malloc(arg ? arg : 1);
+        mybuf_contig1_init_inline(ent->obj, ent->storage, arg);
+        return 0;
+
+    case MYBUF_TRACE_REGPOOL_INIT:
+        ent = replay_slot(ctx, id);
+        if (ent->kind != REPLAY_NONE) {
+            return -1;
+        }
+        ent->kind = REPLAY_REGPOOL;
+        ent->obj = malloc(sizeof(mybuf_regpool_t));
+        mybuf_regpool_init(ent->obj);
+        return 0;
+
+    case MYBUF_TRACE_CONTIG1_CLEANUP:
+    case MYBUF_TRACE_CONTIG1_APPEND:
+    case MYBUF_TRACE_CONTIG1_COMPACT:
+    case MYBUF_TRACE_CONTIG1_CHOP:
+    case MYBUF_TRACE_CONTIG1_MOVE:
+        if ((ent = replay_get(ctx, id, REPLAY_CONTIG1)) == NULL) {
+            return -1;
+        }
+        if (op == MYBUF_TRACE_CONTIG1_MOVE) {
+            /** Only the application's handle moved; the id follows it */
+            return 0;
+
+        } else if (op == MYBUF_TRACE_CONTIG1_CLEANUP) {
+            mybuf_contig1_cleanup(ent->obj);
+            free(ent->obj);
+            free(ent->storage);
+            memset(ent, 0, sizeof(*ent));
+
+        } else if (op == MYBUF_TRACE_CONTIG1_APPEND) {
+            if (arg > ctx->nscratch) {
+                free(ctx->scratch);
+                ctx->scratch = calloc(1, arg);
+                ctx->nscratch = arg;
+            }
+            mybuf_contig1_append(ent->obj, ctx->scratch, arg);
+
+        } else if (op == MYBUF_TRACE_CONTIG1_COMPACT) {
+            mybuf_contig1_compact(ent->obj);
+
+        } else {
+            if (arg > ((mybuf_contig1_t *)ent->obj)->length) {
+                return -1;
+            }
+            mybuf_contig1_chop(ent->obj, arg);
+        }
+        return 0;
+
+    case MYBUF_TRACE_GET_REGION: {
+        replay_obj_t *reg;
+        mybuf_region_t *region = NULL;
+
+        if ((ent = replay_get(ctx, id, REPLAY_REGPOOL)) == NULL) {
+            return -1;
+        }
+        reg = replay_slot(ctx, child);
+        /** replay_slot() may have moved the table */
+        ent = ctx->objs + id;
+        if (reg->kind != REPLAY_NONE) {
+            return -1;
+        }
+        mybuf_regpool_get_region(ent->obj, arg, &region);
+        reg->kind = REPLAY_REGION;
+        reg->obj = region;
+        reg->pool = ent->obj;
+        return 0;
+    }
+
+    case MYBUF_TRACE_PIN:
+    case MYBUF_TRACE_UNPIN:
+    case MYBUF_TRACE_FREE_REGION:
+    case MYBUF_TRACE_SET_PRIORITY:
+        if ((ent = replay_get(ctx, id, REPLAY_REGION)) == NULL) {
+            return -1;
+        }
+        if (op == MYBUF_TRACE_SET_PRIORITY) {
+            mybuf_regpool_set_priority(ent->pool, ent->obj, arg);
+        } else if (op == MYBUF_TRACE_PIN) {
+            mybuf_regpool_pin(ent->pool, ent->obj);
+        } else if (op == MYBUF_TRACE_UNPIN) {
+            mybuf_regpool_unpin(ent->pool, ent->obj);
+        } else {
+            mybuf_regpool_free_region(ent->pool, ent->obj);
+            memset(ent, 0, sizeof(*ent));
+        }
+        return 0;
+
+    case MYBUF_TRACE_REGPOOL_CLEAN:
+    case MYBUF_TRACE_IOV_GET:
+    case MYBUF_TRACE_IOV_DONE:
+    case MYBUF_TRACE_DGRAM_GET:
+    case MYBUF_TRACE_DGRAM_DONE:
+        if ((ent = replay_get(ctx, id, REPLAY_REGPOOL)) == NULL) {
+            return -1;
+        }
+        if (op == MYBUF_TRACE_REGPOOL_CLEAN) {
+            mybuf_regpool_clean(ent->obj);
+            free(ent->obj);
+            memset(ent, 0, sizeof(*ent));
+
+        } else if (op == MYBUF_TRACE_IOV_GET) {
+            if (arg == 0 || arg > MYBUF_IOV_MAX) {
+                arg = MYBUF_IOV_MAX;
+            }
+            mybuf_regpool_iov_get(ent->obj, iov, arg);
+
+        } else if (op == MYBUF_TRACE_IOV_DONE) {
+            mybuf_regpool_iov_done(ent->obj, arg);
+
+        } else if (op == MYBUF_TRACE_DGRAM_GET) {
+            if (arg > MYBUF_IOV_MAX) {
+                arg = MYBUF_IOV_MAX;
+            }
+            mybuf_regpool_dgram_get(ent->obj, iov, arg);
+
+        } else {
+            mybuf_regpool_dgram_done(ent->obj, arg);
+        }
+        return 0;
+
+    case MYBUF_TRACE_SHARED_NEW:
+        ent = replay_slot(ctx, id);
+        if (ent->kind != REPLAY_NONE) {
+            return -1;
+        }
+        ent->kind = REPLAY_SHARED;
+        ent->obj = mybuf_shared_new(NULL, arg);
+        ent->refs = 1;
+        return 0;
+
+    case MYBUF_TRACE_SHARED_REF:
+    case MYBUF_TRACE_SHARED_UNREF:
+    case MYBUF_TRACE_SHARED_FREE:
+        if ((ent = replay_get(ctx, id, REPLAY_SHARED)) == NULL) {
+            return -1;
+        }
+        if (op == MYBUF_TRACE_SHARED_REF) {
+            mybuf_shared_ref(ent->obj);
+            ent->refs++;
+        } else if (op == MYBUF_TRACE_SHARED_UNREF) {
+            if (!ent->refs) {
+                return -1;
+            }
+            ent->refs--;
+            mybuf_shared_unref(ent->obj);
+        } else {
+            /** Already freed by the replayed call which dropped it */
+            memset(ent, 0, sizeof(*ent));
+        }
+        return 0;
+
+    case MYBUF_TRACE_ADD_SHARED: {
+        replay_obj_t *sh;
+        if ((ent = replay_get(ctx, id, REPLAY_REGPOOL)) == NULL ||
+                (sh = replay_get(ctx, child, REPLAY_SHARED)) == NULL) {
+            return -1;
+        }
+        mybuf_regpool_add_shared(ent->obj, sh->obj);
+        return 0;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+static void
+replay_cleanup(replay_ctx_t *ctx)
+{
+    unsigned long ii;
+
+    /** Regions first, as they refer to their pools */
+    for (ii = 0; ii < ctx->nobjs; ii++) {
+        replay_obj_t *ent = ctx->objs + ii;
+        if (ent->kind == REPLAY_REGION) {
+            mybuf_region_t *region = ent->obj;
+            if (region->flags & MYBUF_REGION_F_PINNED) {
+                mybuf_regpool_unpin(ent->pool, region);
+            }
+            mybuf_regpool_free_region(ent->pool, region);
+        }
+    }
+
+    /** Drop application references; pools hold their own */
+    for (ii = 0; ii < ctx->nobjs; ii++) {
+        replay_obj_t *ent = ctx->objs + ii;
+        if (ent->kind == REPLAY_SHARED) {
+            while (ent->refs--) {
+                mybuf_shared_unref(ent->obj);
+            }
+        }
+    }
+
+    for (ii = 0; ii < ctx->nobjs; ii++) {
+        replay_obj_t *ent = ctx->objs + ii;
+        if (ent->kind == REPLAY_CONTIG1) {
+            mybuf_contig1_cleanup(ent->obj);
+            free(ent->obj);
+            free(ent->storage);
+        } else if (ent->kind == REPLAY_REGPOOL) {
+            mybuf_regpool_clean(ent->obj);
+            free(ent->obj);
+        }
+    }
+
+    free(ctx->objs);
+    free(ctx->scratch);
+}
+
+int
+mybuf_trace_replay(FILE *fp, mybuf_replay_result_t *result)
+{
+    char magic[5];
+    replay_ctx_t ctx;
+    struct timeval begin, end;
+    int rv = 0, stats_enabled = mybuf_stats_enabled;
+
+    memset(result, 0, sizeof(*result));
+    memset(&ctx, 0, sizeof(ctx));
+
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+            memcmp(magic, MYBUF_TRACE_MAGIC, 4) != 0 ||
+            magic[4] != MYBUF_TRACE_VERSION) {
+        return -1;
+    }
+
+    memset(&mybuf_stats, 0, sizeof(mybuf_stats));
+    mybuf_stats_enabled = 1;
+    gettimeofday(&begin, NULL);
+
+    for (;;) {
+        int op;
+        unsigned long delta, id, arg, child = 0;
+
+        if ((op = getc(fp)) == EOF) {
+            break;
+        }
+
+        if (get_varint(fp, &delta) != 0 ||
+                get_varint(fp, &id) != 0 ||
+                get_varint(fp, &arg) != 0 ||
+                ((op == MYBUF_TRACE_GET_REGION ||
+                        op == MYBUF_TRACE_ADD_SHARED) &&
+                        get_varint(fp, &child) != 0)) {
+            rv = -1;
+            break;
+        }
+
+        if (replay_one(&ctx, op, id, arg, child) != 0) {
+            rv = -1;
+            break;
+        }
+
+        result->nrecords++;
+        result->traced_usec += delta;
+    }
+
+    gettimeofday(&end, NULL);
+    result->wall_usec = usec_since(&begin, &end);
+
+    replay_cleanup(&ctx);
+    mybuf_stats_enabled = stats_enabled;
+    return rv;
+}
@@ -0,0 +1,129 @@
+#ifndef MYBUF_TRACE_H
+#define MYBUF_TRACE_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Workload tracing for contig1 and regpool.
+ *
+ * When a trace is active, every public contig1/regpool call is appended to a
+ * compact binary stream together with its size argument and the time elapsed
+ * since the previous call. The stream can later be replayed against a
+ * different set of mybuf_settings (see mybuf.h) in order to compare the
+ * amount of copying, memory and allocations each configuration incurs.
+ *
+ * The tracer is process-global and not thread safe; only one trace may be
+ * active at a time. Tracing is unsupported in programs which use buffers or
+ * pools from more than one thread, as concurrent calls would interleave
+ * their records. The one exception is free_region_remote(), which records
+ * nothing itself; the release is recorded when the owner drains its queue.
+ *
+ * File format: the 4 byte magic "MYBT" followed by a single version byte,
+ * then a sequence of records. Each record is an opcode byte followed by
+ * unsigned LEB128 varints:
+ *
+ *      <op> <delta_usec> <object id> <argument> [<child id>]
+ *
+ * The child id is only present for MYBUF_TRACE_GET_REGION, where it denotes
+ * the newly created region, and for MYBUF_TRACE_ADD_SHARED, where it denotes
+ * the payload being queued. Object ids are recycled once the object is
+ * destroyed; MYBUF_TRACE_SHARED_FREE marks the point at which the last
+ * reference to a shared payload was dropped. An object keeps its id when
+ * it is moved by mybuf_contig1_move(), recorded as MYBUF_TRACE_CONTIG1_MOVE.
+ *
+ * Objects which already exist when the trace is started are described when
+ * they are first used, by implicit records with a zero delta which recreate
+ * their current state: a pool, for instance, is written as a REGPOOL_INIT
+ * followed by a GET_REGION for each of its regions. Traces may therefore be
+ * started at any point in the life of a program.
+ */
+
+#define MYBUF_TRACE_MAGIC "MYBT"
+#define MYBUF_TRACE_VERSION 1
+
+typedef enum {
+    MYBUF_TRACE_CONTIG1_INIT = 1,
+    MYBUF_TRACE_CONTIG1_CLEANUP,
+    MYBUF_TRACE_CONTIG1_APPEND,
+    MYBUF_TRACE_CONTIG1_COMPACT,
+    MYBUF_TRACE_CONTIG1_CHOP,
+    MYBUF_TRACE_REGPOOL_INIT,
+    MYBUF_TRACE_REGPOOL_CLEAN,
+    MYBUF_TRACE_GET_REGION,
+    MYBUF_TRACE_PIN,
+    MYBUF_TRACE_UNPIN,
+    MYBUF_TRACE_FREE_REGION,
+    MYBUF_TRACE_IOV_GET,
+    MYBUF_TRACE_IOV_DONE,
+    MYBUF_TRACE_SHARED_NEW,
+    MYBUF_TRACE_SHARED_REF,
+    MYBUF_TRACE_SHARED_UNREF,
+    MYBUF_TRACE_SHARED_FREE,
+    MYBUF_TRACE_ADD_SHARED,
+    MYBUF_TRACE_DGRAM_GET,
+    MYBUF_TRACE_DGRAM_DONE,
+    MYBUF_TRACE_SET_PRIORITY,
+    MYBUF_TRACE_CONTIG1_INIT_INLINE,
+    MYBUF_TRACE_CONTIG1_MOVE,
+    MYBUF_TRACE__MAX
+} mybuf_trace_op_t;
+
+/** Non-zero while a trace is being recorded */
+extern int mybuf_trace_active;
+
+/**
+ * Begin recording into 'fp'. The stream is not closed by the tracer.
+ * mybuf_stats_enabled is set until the trace is stopped.
+ * @return 0 on success, -1 if a trace is already active or on write error
+ */
+int mybuf_trace_start(FILE *fp);
+
+/**
+ * Stop recording and flush the stream. Any object ids still outstanding are
+ * discarded.
+ */
+void mybuf_trace_stop(void);
+
+/**
+ * Record a single call. This is invoked by mybuf.c itself and need not be
+ * called by users.
+ * @param op the operation
+ * @param obj the object the operation is performed on
+ * @param arg size argument of the operation, or 0
+ * @param child the region created by GET_REGION, the payload queued by
+ *  ADD_SHARED, or the new location of the buffer for CONTIG1_MOVE
+ */
+void mybuf_trace_record(mybuf_trace_op_t op, const void *obj,
+                        unsigned long arg, const void *child);
+
+/** Results of replaying a trace */
+typedef struct {
+    /** Number of records replayed */
+    unsigned long nrecords;
+
+    /** Wall time taken by the replay, in microseconds */
+    unsigned long wall_usec;
+
+    /** Total time between the first and last record, as recorded */
+    unsigned long traced_usec;
+} mybuf_replay_result_t;
+
+/**
+ * Replay a trace previously written by mybuf_trace_start(). The calls are
+ * performed against the current mybuf_settings, and mybuf_stats is reset
+ * before the replay begins so that it reflects only the replayed workload;
+ * it is maintained for the duration of the replay regardless of
+ * mybuf_stats_enabled.
+ *
+ * @return 0 on success, -1 if the stream is malformed or truncated
+ */
+int mybuf_trace_replay(FILE *fp, mybuf_replay_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* MYBUF_TRACE_H */